@@ -31,15 +31,16 @@ void init_sqlite() {
 	sqlite_started = true;
 }
 
-sqlite3statement::sqlite3statement(sqlite3_stmt* s) : statement(s), ref_count(1) {}
+sqlite3statement::sqlite3statement(sqlite3_stmt* s) : statement(s), ref_count(1), cached(false) {}
 void sqlite3statement::add_ref() {
 	asAtomicInc(ref_count);
 }
 void sqlite3statement::release() {
-	if (asAtomicDec(ref_count) < 1) {
+	int refs = asAtomicDec(ref_count);
+	if (refs < 1) {
 		sqlite3_finalize(statement);
 		delete this;
-	}
+	} else if (refs == 1 && cached) sqlite3_reset(statement); // Back to just the statement cache, so don't hold a read transaction open until the next prepare.
 }
 int sqlite3statement::step() { return sqlite3_step(statement); }
 int sqlite3statement::reset() { return sqlite3_reset(statement); }
@@ -65,8 +66,199 @@ asINT64 sqlite3statement::column_int64(int index) { return sqlite3_column_int64(
 std::string sqlite3statement::column_name(int index) { return stdstr(sqlite3_column_name(statement, index)); }
 int sqlite3statement::column_type(int index) { return sqlite3_column_type(statement, index); }
 std::string sqlite3statement::column_text(int index) { return stdstr((const char*)sqlite3_column_text(statement, index), column_bytes(index)); }
+// Where one column of a row goes: the array chosen by the caller's type map and the column's slot within that array's share of the row.
+struct sqlite3column_target {
+	int column;
+	CScriptArray* array;
+	int type;
+	asUINT slot;
+};
+// Routes each column to the single array its entry in types names, so that every column is converted exactly once. Columns typed SQLITE_NULL, past the end of types or aimed at a null array are skipped. widths receives how many columns each array takes per row.
+static std::vector<sqlite3column_target> plan_columns(sqlite3_stmt* statement, CScriptArray* types, CScriptArray* ints, CScriptArray* doubles, CScriptArray* strings, asUINT widths[3]) {
+	std::vector<sqlite3column_target> plan;
+	widths[0] = widths[1] = widths[2] = 0;
+	CScriptArray* const arrays[3] = {ints, doubles, strings};
+	const int count = types ? std::min<int>(sqlite3_column_count(statement), types->GetSize()) : 0;
+	for (int i = 0; i < count; i++) {
+		const int type = *(const int*)types->At(i);
+		const int target = type == SQLITE_INTEGER ? 0 : type == SQLITE_FLOAT ? 1 : type == SQLITE_TEXT || type == SQLITE_BLOB ? 2 : -1;
+		if (target < 0 || !arrays[target]) continue;
+		plan.push_back({i, arrays[target], type, widths[target]++});
+	}
+	return plan;
+}
+// Writes the current row into the planned arrays, each starting at row * its width. Strings are assigned in place so that arrays reused across calls keep their capacity.
+static void store_row(sqlite3_stmt* statement, const std::vector<sqlite3column_target>& plan, asUINT row, const asUINT widths[3]) {
+	for (const sqlite3column_target& t : plan) {
+		switch (t.type) {
+			case SQLITE_INTEGER:
+				*(asINT64*)t.array->At(row * widths[0] + t.slot) = sqlite3_column_int64(statement, t.column);
+				break;
+			case SQLITE_FLOAT:
+				*(double*)t.array->At(row * widths[1] + t.slot) = sqlite3_column_double(statement, t.column);
+				break;
+			default: {
+				const char* data = t.type == SQLITE_BLOB ? (const char*)sqlite3_column_blob(statement, t.column) : (const char*)sqlite3_column_text(statement, t.column);
+				std::string* str = (std::string*)t.array->At(row * widths[2] + t.slot);
+				if (data) str->assign(data, sqlite3_column_bytes(statement, t.column));
+				else str->clear();
+			}
+		}
+	}
+}
+static void ensure_array_size(CScriptArray* array, asUINT size) {
+	if (!array || array->GetSize() >= size) return;
+	// Grow geometrically, as fetch_all appends a row at a time.
+	array->Resize(size > array->GetSize() * 2 ? size : array->GetSize() * 2);
+}
+int sqlite3statement::step_into(CScriptArray* types, CScriptArray* ints, CScriptArray* doubles, CScriptArray* strings) {
+	int ret = sqlite3_step(statement);
+	if (ret != SQLITE_ROW) return ret;
+	asUINT widths[3];
+	const std::vector<sqlite3column_target> plan = plan_columns(statement, types, ints, doubles, strings, widths);
+	if (ints) ints->Resize(widths[0]);
+	if (doubles) doubles->Resize(widths[1]);
+	if (strings) strings->Resize(widths[2]);
+	store_row(statement, plan, 0, widths);
+	return ret;
+}
+int sqlite3statement::fetch_all(CScriptArray* types, int max_rows, CScriptArray* ints, CScriptArray* doubles, CScriptArray* strings) {
+	asUINT widths[3];
+	const std::vector<sqlite3column_target> plan = plan_columns(statement, types, ints, doubles, strings, widths);
+	int rows = 0;
+	int ret = SQLITE_ROW;
+	while (max_rows <= 0 || rows < max_rows) {
+		ret = sqlite3_step(statement);
+		if (ret != SQLITE_ROW) break;
+		ensure_array_size(ints, (rows + 1) * widths[0]);
+		ensure_array_size(doubles, (rows + 1) * widths[1]);
+		ensure_array_size(strings, (rows + 1) * widths[2]);
+		store_row(statement, plan, rows, widths);
+		rows++;
+	}
+	if (ints) ints->Resize(rows * widths[0]);
+	if (doubles) doubles->Resize(rows * widths[1]);
+	if (strings) strings->Resize(rows * widths[2]);
+	if (ret != SQLITE_ROW && ret != SQLITE_DONE) return -ret;
+	return rows;
+}
+// Binds a script value of the given type id, as found in an array element or dictionary entry.
+static int bind_script_value(sqlite3_stmt* statement, int index, const void* value, int type_id) {
+	if (type_id & asTYPEID_OBJHANDLE) {
+		if (!value || !*(void* const*)value) return sqlite3_bind_null(statement, index);
+		value = *(void* const*)value;
+		type_id &= ~asTYPEID_OBJHANDLE;
+	}
+	switch (type_id) {
+		case asTYPEID_BOOL: return sqlite3_bind_int(statement, index, *(const bool*)value);
+		case asTYPEID_INT8: return sqlite3_bind_int(statement, index, *(const asINT8*)value);
+		case asTYPEID_INT16: return sqlite3_bind_int(statement, index, *(const asINT16*)value);
+		case asTYPEID_INT32: return sqlite3_bind_int(statement, index, *(const int*)value);
+		case asTYPEID_INT64: return sqlite3_bind_int64(statement, index, *(const asINT64*)value);
+		case asTYPEID_UINT8: return sqlite3_bind_int(statement, index, *(const asBYTE*)value);
+		case asTYPEID_UINT16: return sqlite3_bind_int(statement, index, *(const asWORD*)value);
+		case asTYPEID_UINT32: return sqlite3_bind_int64(statement, index, *(const asDWORD*)value);
+		case asTYPEID_UINT64: return sqlite3_bind_int64(statement, index, (sqlite3_int64) * (const asQWORD*)value);
+		case asTYPEID_FLOAT: return sqlite3_bind_double(statement, index, *(const float*)value);
+		case asTYPEID_DOUBLE: return sqlite3_bind_double(statement, index, *(const double*)value);
+	}
+	// Looked up once rather than parsing the declaration for every value of a batch; the engine and its string type outlive the plugin's scripts.
+	static const int string_type_id = g_ScriptEngine->GetTypeIdByDecl("string");
+	if (type_id == string_type_id) {
+		const std::string* str = (const std::string*)value;
+		return sqlite3_bind_text64(statement, index, str->data(), str->size(), SQLITE_TRANSIENT, SQLITE_UTF8);
+	}
+	return SQLITE_MISMATCH;
+}
+// Parameters may be named with or without their :, @ or $ prefix, or given as a 1-based index.
+static int find_parameter(sqlite3_stmt* statement, const std::string& name) {
+	if (name.empty()) return 0;
+	if (name.find_first_not_of("0123456789") == std::string::npos) {
+		const int index = atoi(name.c_str());
+		return index <= sqlite3_bind_parameter_count(statement) ? index : 0;
+	}
+	if (int index = sqlite3_bind_parameter_index(statement, name.c_str())) return index;
+	for (const char* prefix : {":", "@", "$"}) {
+		if (int index = sqlite3_bind_parameter_index(statement, (prefix + name).c_str())) return index;
+	}
+	return 0;
+}
+// Runs fn inside a savepoint, so execute_many is atomic and joins any transaction already open. fn returns the rows changed or a negated error code.
+template <class F> static asINT64 run_batch(sqlite3_stmt* statement, F fn) {
+	sqlite3* db = sqlite3_db_handle(statement);
+	if (int rc = sqlite3_exec(db, "savepoint execute_many", NULL, NULL, NULL); rc != SQLITE_OK) return -rc;
+	sqlite3_reset(statement);
+	asINT64 ret = fn();
+	sqlite3_reset(statement);
+	if (ret < 0) sqlite3_exec(db, "rollback to execute_many", NULL, NULL, NULL);
+	sqlite3_exec(db, "release execute_many", NULL, NULL, NULL);
+	return ret;
+}
+static asINT64 step_batch_row(sqlite3_stmt* statement) {
+	int rc = sqlite3_step(statement);
+	if (rc != SQLITE_DONE && rc != SQLITE_ROW) return -rc;
+	sqlite3_reset(statement);
+	return sqlite3_changes64(sqlite3_db_handle(statement));
+}
+// Dictionary values can be any type, so make sure one holds an array<T> before treating it as a CScriptArray.
+static bool is_script_array(int type_id) {
+	asITypeInfo* type = g_ScriptEngine->GetTypeInfoById(type_id & ~asTYPEID_OBJHANDLE);
+	asITypeInfo* array_type = g_ScriptEngine->GetTypeInfoById(g_ScriptEngine->GetDefaultArrayTypeId());
+	return type && array_type && (type->GetFlags() & asOBJ_TEMPLATE) && std::string(type->GetName()) == array_type->GetName();
+}
+asINT64 sqlite3statement::execute_many(CScriptDictionary* columns) {
+	if (!columns) return -SQLITE_MISUSE;
+	struct bound_column {
+		int index;
+		CScriptArray* values;
+	};
+	std::vector<bound_column> bound;
+	asUINT rows = 0;
+	for (auto it = columns->begin(); it != columns->end(); ++it) {
+		if (!is_script_array(it.GetTypeId())) return -SQLITE_MISMATCH;
+		// d["a"] = values stores a copy of the array, d["a"] = @values a handle to it.
+		CScriptArray* values = it.GetTypeId() & asTYPEID_OBJHANDLE ? *(CScriptArray* const*)it.GetAddressOfValue() : (CScriptArray*)it.GetAddressOfValue();
+		const int index = find_parameter(statement, it.GetKey());
+		if (!values || !index) return -SQLITE_RANGE;
+		if (!bound.empty() && values->GetSize() != rows) return -SQLITE_MISMATCH;
+		rows = values->GetSize();
+		bound.push_back({index, values});
+	}
+	return run_batch(statement, [&]() -> asINT64 {
+		asINT64 changed = 0;
+		for (asUINT row = 0; row < rows; row++) {
+			for (const auto& column : bound) {
+				if (int rc = bind_script_value(statement, column.index, column.values->At(row), column.values->GetElementTypeId()); rc != SQLITE_OK) return -rc;
+			}
+			asINT64 ret = step_batch_row(statement);
+			if (ret < 0) return ret;
+			changed += ret;
+		}
+		return changed;
+	});
+}
+asINT64 sqlite3statement::execute_many(CScriptArray* rows) {
+	if (!rows) return -SQLITE_MISUSE;
+	return run_batch(statement, [&]() -> asINT64 {
+		asINT64 changed = 0;
+		for (asUINT row = 0; row < rows->GetSize(); row++) {
+			CScriptDictionary* values = *(CScriptDictionary**)rows->At(row);
+			if (!values) continue;
+			sqlite3_clear_bindings(statement);
+			for (auto it = values->begin(); it != values->end(); ++it) {
+				const int index = find_parameter(statement, it.GetKey());
+				if (!index) return -SQLITE_RANGE;
+				if (int rc = bind_script_value(statement, index, it.GetAddressOfValue(), it.GetTypeId()); rc != SQLITE_OK) return -rc;
+			}
+			asINT64 ret = step_batch_row(statement);
+			if (ret < 0) return ret;
+			changed += ret;
+		}
+		return changed;
+	});
+}
 
-sqlite3context::sqlite3context(sqlite3_context* ctx) : ref_count(1), c(ctx) {}
+sqlite3context::sqlite3context(sqlite3_context* ctx) : ref_count(1), c(ctx), user_data(NULL) {}
 void sqlite3context::add_ref() {
 	asAtomicInc(ref_count);
 }
@@ -96,6 +288,8 @@ double sqlite3value::get_double() { return sqlite3_value_double(v); }
 int sqlite3value::get_int() { return sqlite3_value_int(v); }
 asINT64 sqlite3value::get_int64() { return sqlite3_value_int64(v); }
 int sqlite3value::get_type() { return sqlite3_value_type(v); }
+std::string sqlite3context::get_user_data() { return user_data ? *user_data : ""; }
+
 std::string sqlite3value::get_text() { return stdstr((const char*)sqlite3_value_text(v), get_bytes()); }
 
 
@@ -104,25 +298,40 @@ std::string sqlite3value::get_text() { return stdstr((const char*)sqlite3_value_
 int sqlite_authorizer_callback(void* user_data, int action, const char* extra1, const char* extra2, const char* extra3, const char* extra4) {
 	sqlite3DB* db = (sqlite3DB*)user_data;
 	if (!db->authorizer) return SQLITE_ABORT;
-	asIScriptContext* ctx = g_ScriptEngine->RequestContext();
+	// With caching on, a check with the same action and arguments reuses the earlier decision.
+	auto set_key = [&]() {
+		db->authorizer_key.assign(1, char(action));
+		for (const char* extra : {extra1, extra2, extra3, extra4}) db->authorizer_key.append(extra ? extra : "").push_back('\0');
+	};
+	if (db->authorizer_cache_decisions) {
+		set_key();
+		auto it = db->authorizer_cache.find(db->authorizer_key);
+		if (it != db->authorizer_cache.end()) return it->second;
+	}
+	if (!db->authorizer_context) db->authorizer_context = g_ScriptEngine->CreateContext();
+	// The authorizer can be reentered when it prepares a statement of its own, which can't reuse the context still running it.
+	asIScriptContext* ctx = db->authorizer_context && db->authorizer_context->GetState() != asEXECUTION_ACTIVE ? db->authorizer_context : g_ScriptEngine->RequestContext();
 	if (!ctx) return SQLITE_ABORT;
-	if (ctx->Prepare(db->authorizer) < 0) {
-		g_ScriptEngine->ReturnContext(ctx);
-		return SQLITE_ABORT;
-	}
-	std::string x1 = (extra1 ? extra1 : ""), x2 = (extra2 ? extra2 : ""), x3 = (extra3 ? extra3 : ""), x4 = (extra4 ? extra4 : "");
-	ctx->SetArgObject(0, &db->authorizer_user_data);
-	ctx->SetArgDWord(1, action);
-	ctx->SetArgObject(2, &x1);
-	ctx->SetArgObject(3, &x2);
-	ctx->SetArgObject(4, &x3);
-	ctx->SetArgObject(5, &x4);
-	if (ctx->Execute() != asEXECUTION_FINISHED) {
-		g_ScriptEngine->ReturnContext(ctx);
-		return SQLITE_ABORT;
-	}
-	int ret = ctx->GetReturnDWord();
-	g_ScriptEngine->ReturnContext(ctx);
+	int ret = SQLITE_ABORT;
+	if (ctx->Prepare(db->authorizer) >= 0) {
+		const char* extras[4] = {extra1, extra2, extra3, extra4};
+		std::string args[4];
+		std::string* arg_buffers = ctx == db->authorizer_context ? db->authorizer_args : args;
+		ctx->SetArgObject(0, &db->authorizer_user_data);
+		ctx->SetArgDWord(1, action);
+		for (int i = 0; i < 4; i++) {
+			arg_buffers[i].assign(extras[i] ? extras[i] : "");
+			ctx->SetArgObject(i + 2, &arg_buffers[i]);
+		}
+		if (ctx->Execute() == asEXECUTION_FINISHED) {
+			ret = ctx->GetReturnDWord();
+			if (db->authorizer_cache_decisions) {
+				set_key(); // A nested check may have replaced the key while the script ran.
+				db->authorizer_cache[db->authorizer_key] = ret;
+			}
+		} else if (ctx->GetState() == asEXECUTION_SUSPENDED) ctx->Abort();
+	}
+	if (ctx != db->authorizer_context) g_ScriptEngine->ReturnContext(ctx);
 	return ret;
 }
 int sqlite3exec_callback(void* user, int colc, char** colvs, char** colns) {
@@ -136,27 +345,123 @@ int sqlite3exec_callback(void* user, int colc, char** colvs, char** colns) {
 		((std::string*)(array->At(i)))->assign(stdstr(colvs[i]));
 	return SQLITE_OK;
 }
-typedef struct {
+// One script function registered on one connection. The execution context and the context/value wrappers passed to the script are created once and reused for every row, and are only replaced when the script kept a handle to them.
+class sqlite3func {
+public:
 	asIScriptFunction* func;
-	std::string userdata;
-} sqlite3func;
+	asIScriptFunction* final;
+	std::string user_data;
+	asIScriptContext* ctx;
+	sqlite3context* context;
+	CScriptArray* args;
+	sqlite3func(asIScriptFunction* f, asIScriptFunction* fin, const std::string& data) : func(f), final(fin), user_data(data), ctx(NULL), context(NULL), args(NULL) {}
+	~sqlite3func() {
+		if (func) func->Release();
+		if (final) final->Release();
+		if (context) context->release();
+		if (args) args->Release();
+		if (ctx) ctx->Release();
+	}
+	asIScriptContext* prepare(asIScriptFunction* f) {
+		if (!ctx) ctx = g_ScriptEngine->CreateContext();
+		// A function reentered through a nested query can't share the context that is still running it.
+		asIScriptContext* c = ctx && ctx->GetState() != asEXECUTION_ACTIVE ? ctx : g_ScriptEngine->RequestContext();
+		if (c && c->Prepare(f) < 0) {
+			done(c);
+			return NULL;
+		}
+		return c;
+	}
+	void done(asIScriptContext* c) {
+		if (c != ctx) g_ScriptEngine->ReturnContext(c);
+	}
+	sqlite3context* get_context(sqlite3_context* sctx) {
+		if (context && context->ref_count > 1) {
+			context->release();
+			context = NULL;
+		}
+		if (!context) context = new sqlite3context(sctx);
+		context->c = sctx;
+		context->user_data = &user_data;
+		return context;
+	}
+	CScriptArray* get_args(int argc, sqlite3_value** argv) {
+		if (args && args->GetRefCount() > 1) {
+			args->Release();
+			args = NULL;
+		}
+		if (!args) args = CScriptArray::Create(g_ScriptEngine->GetTypeInfoByDecl("array<sqlite3value@>"));
+		if (args->GetSize() != asUINT(argc)) args->Resize(argc);
+		for (int i = 0; i < argc; i++) {
+			sqlite3value* val = *(sqlite3value**)args->At(i);
+			if (!val || val->ref_count > 1) {
+				val = new sqlite3value(argv[i]);
+				args->SetValue(i, &val);
+				val->release();
+			}
+			val->v = argv[i];
+		}
+		return args;
+	}
+	// Executes a prepared context and reports a script exception or abort as the SQL function's error.
+	void execute(asIScriptContext* c, sqlite3_context* sctx) {
+		int ret = c->Execute();
+		if (ret == asEXECUTION_EXCEPTION) sqlite3_result_error(sctx, c->GetExceptionString(), -1);
+		else if (ret != asEXECUTION_FINISHED) {
+			if (ret == asEXECUTION_SUSPENDED) c->Abort();
+			sqlite3_result_error(sctx, "angelscript function did not finish executing", -1);
+		}
+		done(c);
+	}
+};
+static void sqlite3func_destroy(void* user) { delete (sqlite3func*)user; }
 void sqlite3func_callback(sqlite3_context* sctx, int argc, sqlite3_value** argv) {
 	sqlite3func* f = (sqlite3func*)sqlite3_user_data(sctx);
-	asIScriptContext* ctx = g_ScriptEngine->RequestContext();
+	asIScriptContext* ctx = f->prepare(f->func);
 	if (!ctx) {
-		sqlite3_result_error(sctx, "Unable to acquire angelscript context", -1);
+		sqlite3_result_error(sctx, "Unable to prepare angelscript function", -1);
 		return;
 	}
-	if (ctx->Prepare(f->func) < 0) {
+	ctx->SetArgObject(0, f->get_context(sctx));
+	ctx->SetArgObject(1, f->get_args(argc, argv));
+	f->execute(ctx, sctx);
+}
+// Each aggregate group keeps a dictionary in its SQLite aggregate context for the script to accumulate into.
+void sqlite3aggregate_step_callback(sqlite3_context* sctx, int argc, sqlite3_value** argv) {
+	sqlite3func* f = (sqlite3func*)sqlite3_user_data(sctx);
+	CScriptDictionary** state = (CScriptDictionary**)sqlite3_aggregate_context(sctx, sizeof(CScriptDictionary*));
+	if (!state) {
+		sqlite3_result_error_nomem(sctx);
+		return;
+	}
+	if (!*state) *state = CScriptDictionary::Create(g_ScriptEngine);
+	asIScriptContext* ctx = f->prepare(f->func);
+	if (!ctx) {
 		sqlite3_result_error(sctx, "Unable to prepare angelscript function", -1);
 		return;
 	}
-
+	ctx->SetArgObject(0, f->get_context(sctx));
+	ctx->SetArgObject(1, f->get_args(argc, argv));
+	ctx->SetArgObject(2, *state);
+	f->execute(ctx, sctx);
+}
+void sqlite3aggregate_final_callback(sqlite3_context* sctx) {
+	sqlite3func* f = (sqlite3func*)sqlite3_user_data(sctx);
+	CScriptDictionary** state = (CScriptDictionary**)sqlite3_aggregate_context(sctx, 0);
+	CScriptDictionary* dict = state && *state ? *state : CScriptDictionary::Create(g_ScriptEngine);
+	asIScriptContext* ctx = f->prepare(f->final);
+	if (!ctx) sqlite3_result_error(sctx, "Unable to prepare angelscript function", -1);
+	else {
+		ctx->SetArgObject(0, f->get_context(sctx));
+		ctx->SetArgObject(1, dict);
+		f->execute(ctx, sctx);
+	}
+	dict->Release();
 }
 
 
-sqlite3DB::sqlite3DB() : db(NULL), authorizer(NULL), ref_count(1) { init_sqlite(); }
-sqlite3DB::sqlite3DB(const std::string& filename, int mode) : db(NULL), authorizer(NULL), ref_count(1) {
+sqlite3DB::sqlite3DB() : db(NULL), authorizer(NULL), authorizer_context(NULL), authorizer_cache_decisions(false), statement_cache_capacity(16), statement_cache_hits(0), statement_cache_misses(0), ref_count(1) { init_sqlite(); }
+sqlite3DB::sqlite3DB(const std::string& filename, int mode) : db(NULL), authorizer(NULL), authorizer_context(NULL), authorizer_cache_decisions(false), statement_cache_capacity(16), statement_cache_hits(0), statement_cache_misses(0), ref_count(1) {
 	open(filename, mode);
 }
 void sqlite3DB::add_ref() {
@@ -164,8 +469,10 @@ void sqlite3DB::add_ref() {
 }
 void sqlite3DB::release() {
 	if (asAtomicDec(ref_count) < 1) {
+		clear_statement_cache();
 		if (db) sqlite3_close_v2(db);
 		if (authorizer) authorizer->Release();
+		if (authorizer_context) authorizer_context->Release();
 		delete this;
 	}
 }
@@ -175,6 +482,12 @@ int sqlite3DB::close() {
 		authorizer->Release();
 		authorizer = NULL;
 	}
+	if (authorizer_context) {
+		authorizer_context->Release();
+		authorizer_context = NULL;
+	}
+	authorizer_cache.clear();
+	clear_statement_cache();
 	if (db) {
 		ret = sqlite3_close(db);
 		db = NULL;
@@ -182,34 +495,100 @@ int sqlite3DB::close() {
 	return ret;
 }
 int sqlite3DB::open(const std::string& filename, int mode) {
+	clear_statement_cache();
 	return sqlite3_open_v2(filename.c_str(), &db, mode, NULL);
 }
 sqlite3statement* sqlite3DB::prepare(const std::string& statement, int* statement_tail) {
 	sqlite3_stmt* st = NULL;
 	const char* tail = NULL;
 	if (!db) return NULL;
-	int err = sqlite3_prepare_v2(db, statement.c_str(), statement.size(), &st, &tail);
+	if (statement_cache_capacity > 0) {
+		auto it = statement_cache_index.find(statement);
+		// A statement the script still holds is mid-use, so identical SQL prepared alongside it gets a statement of its own.
+		if (it != statement_cache_index.end() && it->second->statement->ref_count == 1) {
+			statement_cache.splice(statement_cache.begin(), statement_cache, it->second);
+			sqlite3statement* ret = it->second->statement;
+			sqlite3_reset(ret->statement);
+			sqlite3_clear_bindings(ret->statement);
+			ret->add_ref();
+			if (statement_tail) *statement_tail = it->second->tail;
+			statement_cache_hits++;
+			return ret;
+		}
+		statement_cache_misses++;
+	}
+	int err = sqlite3_prepare_v3(db, statement.c_str(), statement.size(), statement_cache_capacity > 0 ? SQLITE_PREPARE_PERSISTENT : 0, &st, &tail);
 	if (err != SQLITE_OK) return nullptr;
 	sqlite3statement* ret = NULL;
 	if (st)
 		ret = new sqlite3statement(st);
 	if (tail && statement_tail)
 		*statement_tail = (tail - statement.c_str());
+	if (ret && statement_cache_capacity > 0 && !statement_cache_index.count(statement)) {
+		ret->add_ref();
+		ret->cached = true;
+		statement_cache.push_front({statement, ret, tail ? int(tail - statement.c_str()) : int(statement.size())});
+		statement_cache_index[statement] = statement_cache.begin();
+		trim_statement_cache();
+	}
 	return ret;
 }
+void sqlite3DB::trim_statement_cache() {
+	while (statement_cache.size() > asUINT(std::max(statement_cache_capacity, 0))) {
+		statement_cache_entry& oldest = statement_cache.back();
+		oldest.statement->cached = false;
+		oldest.statement->release();
+		statement_cache_index.erase(oldest.sql);
+		statement_cache.pop_back();
+	}
+}
+void sqlite3DB::set_statement_cache_capacity(int capacity) {
+	statement_cache_capacity = capacity;
+	trim_statement_cache();
+}
+void sqlite3DB::clear_statement_cache() {
+	for (statement_cache_entry& entry : statement_cache) {
+		entry.statement->cached = false;
+		entry.statement->release();
+	}
+	statement_cache.clear();
+	statement_cache_index.clear();
+}
 int sqlite3DB::execute(const std::string& statements, CScriptArray* results) {
 	return sqlite3_exec(db, statements.c_str(), (results ? sqlite3exec_callback : NULL), results, NULL);
 }
 asINT64 sqlite3DB::get_rows_changed() { return db ? sqlite3_changes(db) : 0; }
 asINT64 sqlite3DB::get_total_rows_changed() { return db ? sqlite3_total_changes(db) : 0; }
 int sqlite3DB::limit(int id, int val) { return db ? sqlite3_limit(db, id, val) : -1; }
-int sqlite3DB::set_authorizer(asIScriptFunction* auth, const std::string& user_data) {
+int sqlite3DB::set_authorizer(asIScriptFunction* auth, const std::string& user_data, bool cache_decisions) {
 	if (!db) return -1;
 	if (authorizer) authorizer->Release();
 	authorizer = auth;
 	authorizer_user_data = user_data;
+	authorizer_cache_decisions = cache_decisions;
+	authorizer_cache.clear();
 	return sqlite3_set_authorizer(db, (auth ? sqlite_authorizer_callback : NULL), this);
 }
+int sqlite3DB::create_function(const std::string& name, int argc, asIScriptFunction* func, int flags, const std::string& user_data) {
+	if (!db) {
+		if (func) func->Release();
+		return -1;
+	}
+	flags = SQLITE_UTF8 | (flags & (SQLITE_DETERMINISTIC | SQLITE_DIRECTONLY | SQLITE_INNOCUOUS));
+	if (!func) return sqlite3_create_function_v2(db, name.c_str(), argc, flags, NULL, NULL, NULL, NULL, NULL);
+	return sqlite3_create_function_v2(db, name.c_str(), argc, flags, new sqlite3func(func, NULL, user_data), sqlite3func_callback, NULL, NULL, sqlite3func_destroy);
+}
+int sqlite3DB::create_aggregate(const std::string& name, int argc, asIScriptFunction* step, asIScriptFunction* final, int flags, const std::string& user_data) {
+	if (!db || !step != !final) {
+		if (step) step->Release();
+		if (final) final->Release();
+		return db ? SQLITE_MISUSE : -1;
+	}
+	flags = SQLITE_UTF8 | (flags & (SQLITE_DETERMINISTIC | SQLITE_DIRECTONLY | SQLITE_INNOCUOUS));
+	if (!step) return sqlite3_create_function_v2(db, name.c_str(), argc, flags, NULL, NULL, NULL, NULL, NULL);
+	return sqlite3_create_function_v2(db, name.c_str(), argc, flags, new sqlite3func(step, final, user_data), NULL, sqlite3aggregate_step_callback, sqlite3aggregate_final_callback, sqlite3func_destroy);
+}
+void sqlite3DB::clear_authorizer_cache() { authorizer_cache.clear(); }
 asINT64 sqlite3DB::get_last_insert_rowid() { return db ? sqlite3_last_insert_rowid(db) : 0; }
 void sqlite3DB::set_last_insert_rowid(asINT64 val) { if (db) sqlite3_set_last_insert_rowid(db, val); }
 int sqlite3DB::get_last_error() { return db ? sqlite3_errcode(db) : -1; }
@@ -220,6 +599,12 @@ sqlite3DB* new_sqlite3open(const std::string& filename, int mode) { return new s
 
 void RegisterSqlite3(asIScriptEngine* engine) {
 	engine->SetDefaultAccessMask(NVGT_SUBSYSTEM_SQLITE3);
+	engine->RegisterEnum(_O("sqlite3_datatype"));
+	engine->RegisterEnumValue(_O("sqlite3_datatype"), _O("SQLITE_INTEGER"), SQLITE_INTEGER);
+	engine->RegisterEnumValue(_O("sqlite3_datatype"), _O("SQLITE_FLOAT"), SQLITE_FLOAT);
+	engine->RegisterEnumValue(_O("sqlite3_datatype"), _O("SQLITE_TEXT"), SQLITE_TEXT);
+	engine->RegisterEnumValue(_O("sqlite3_datatype"), _O("SQLITE_BLOB"), SQLITE_BLOB);
+	engine->RegisterEnumValue(_O("sqlite3_datatype"), _O("SQLITE_NULL"), SQLITE_NULL);
 	engine->RegisterObjectType(_O("sqlite3statement"), 0, asOBJ_REF);
 	engine->RegisterObjectBehaviour(_O("sqlite3statement"), asBEHAVE_ADDREF, _O("void f()"), asMETHOD(sqlite3statement, add_ref), asCALL_THISCALL);
 	engine->RegisterObjectBehaviour(_O("sqlite3statement"), asBEHAVE_RELEASE, _O("void f()"), asMETHOD(sqlite3statement, release), asCALL_THISCALL);
@@ -247,6 +632,38 @@ void RegisterSqlite3(asIScriptEngine* engine) {
 	engine->RegisterObjectMethod(_O("sqlite3statement"), _O("string column_name(int)"), asMETHOD(sqlite3statement, column_name), asCALL_THISCALL);
 	engine->RegisterObjectMethod(_O("sqlite3statement"), _O("int column_type(int)"), asMETHOD(sqlite3statement, column_type), asCALL_THISCALL);
 	engine->RegisterObjectMethod(_O("sqlite3statement"), _O("string column_text(int)"), asMETHOD(sqlite3statement, column_text), asCALL_THISCALL);
+	engine->RegisterObjectMethod(_O("sqlite3statement"), _O("int step_into(const sqlite3_datatype[]@ types, int64[]@ ints = null, double[]@ doubles = null, string[]@ strings = null)"), asMETHOD(sqlite3statement, step_into), asCALL_THISCALL);
+	engine->RegisterObjectMethod(_O("sqlite3statement"), _O("int64 execute_many(dictionary@ columns)"), asMETHODPR(sqlite3statement, execute_many, (CScriptDictionary*), asINT64), asCALL_THISCALL);
+	engine->RegisterObjectMethod(_O("sqlite3statement"), _O("int64 execute_many(dictionary@[]@ rows)"), asMETHODPR(sqlite3statement, execute_many, (CScriptArray*), asINT64), asCALL_THISCALL);
+	engine->RegisterObjectMethod(_O("sqlite3statement"), _O("int fetch_all(const sqlite3_datatype[]@ types, int max_rows = 0, int64[]@ ints = null, double[]@ doubles = null, string[]@ strings = null)"), asMETHOD(sqlite3statement, fetch_all), asCALL_THISCALL);
+	engine->RegisterObjectType(_O("sqlite3context"), 0, asOBJ_REF);
+	engine->RegisterObjectBehaviour(_O("sqlite3context"), asBEHAVE_ADDREF, _O("void f()"), asMETHOD(sqlite3context, add_ref), asCALL_THISCALL);
+	engine->RegisterObjectBehaviour(_O("sqlite3context"), asBEHAVE_RELEASE, _O("void f()"), asMETHOD(sqlite3context, release), asCALL_THISCALL);
+	engine->RegisterObjectMethod(_O("sqlite3context"), _O("void set_blob(const string&in, bool=true)"), asMETHOD(sqlite3context, set_blob), asCALL_THISCALL);
+	engine->RegisterObjectMethod(_O("sqlite3context"), _O("void set_double(double)"), asMETHOD(sqlite3context, set_double), asCALL_THISCALL);
+	engine->RegisterObjectMethod(_O("sqlite3context"), _O("void set_error(const string&in, int=1)"), asMETHOD(sqlite3context, set_error), asCALL_THISCALL);
+	engine->RegisterObjectMethod(_O("sqlite3context"), _O("void set_int(int)"), asMETHOD(sqlite3context, set_int), asCALL_THISCALL);
+	engine->RegisterObjectMethod(_O("sqlite3context"), _O("void set_int64(int64)"), asMETHOD(sqlite3context, set_int64), asCALL_THISCALL);
+	engine->RegisterObjectMethod(_O("sqlite3context"), _O("void set_null()"), asMETHOD(sqlite3context, set_null), asCALL_THISCALL);
+	engine->RegisterObjectMethod(_O("sqlite3context"), _O("void set_text(const string&in, bool=true)"), asMETHOD(sqlite3context, set_text), asCALL_THISCALL);
+	engine->RegisterObjectMethod(_O("sqlite3context"), _O("string get_user_data() property"), asMETHOD(sqlite3context, get_user_data), asCALL_THISCALL);
+	engine->RegisterObjectType(_O("sqlite3value"), 0, asOBJ_REF);
+	engine->RegisterObjectBehaviour(_O("sqlite3value"), asBEHAVE_ADDREF, _O("void f()"), asMETHOD(sqlite3value, add_ref), asCALL_THISCALL);
+	engine->RegisterObjectBehaviour(_O("sqlite3value"), asBEHAVE_RELEASE, _O("void f()"), asMETHOD(sqlite3value, release), asCALL_THISCALL);
+	engine->RegisterObjectMethod(_O("sqlite3value"), _O("string get_blob() property"), asMETHOD(sqlite3value, get_blob), asCALL_THISCALL);
+	engine->RegisterObjectMethod(_O("sqlite3value"), _O("int get_bytes() property"), asMETHOD(sqlite3value, get_bytes), asCALL_THISCALL);
+	engine->RegisterObjectMethod(_O("sqlite3value"), _O("double get_double() property"), asMETHOD(sqlite3value, get_double), asCALL_THISCALL);
+	engine->RegisterObjectMethod(_O("sqlite3value"), _O("int get_int() property"), asMETHOD(sqlite3value, get_int), asCALL_THISCALL);
+	engine->RegisterObjectMethod(_O("sqlite3value"), _O("int64 get_int64() property"), asMETHOD(sqlite3value, get_int64), asCALL_THISCALL);
+	engine->RegisterObjectMethod(_O("sqlite3value"), _O("int get_type() property"), asMETHOD(sqlite3value, get_type), asCALL_THISCALL);
+	engine->RegisterObjectMethod(_O("sqlite3value"), _O("string get_text() property"), asMETHOD(sqlite3value, get_text), asCALL_THISCALL);
+	engine->RegisterEnum(_O("sqlite3_function_flags"));
+	engine->RegisterEnumValue(_O("sqlite3_function_flags"), _O("SQLITE_DETERMINISTIC"), SQLITE_DETERMINISTIC);
+	engine->RegisterEnumValue(_O("sqlite3_function_flags"), _O("SQLITE_DIRECTONLY"), SQLITE_DIRECTONLY);
+	engine->RegisterEnumValue(_O("sqlite3_function_flags"), _O("SQLITE_INNOCUOUS"), SQLITE_INNOCUOUS);
+	engine->RegisterFuncdef(_O("void sqlite3function(sqlite3context@, sqlite3value@[]@)"));
+	engine->RegisterFuncdef(_O("void sqlite3aggregate_step(sqlite3context@, sqlite3value@[]@, dictionary@)"));
+	engine->RegisterFuncdef(_O("void sqlite3aggregate_final(sqlite3context@, dictionary@)"));
 	engine->RegisterFuncdef(_O("int sqlite3authorizer(string, int, string, string, string, string)"));
 	engine->RegisterObjectType(_O("sqlite3"), 0, asOBJ_REF);
 	engine->RegisterObjectBehaviour(_O("sqlite3"), asBEHAVE_FACTORY, _O("sqlite3@ db()"), asFUNCTION(new_sqlite3), asCALL_CDECL);
@@ -260,7 +677,16 @@ void RegisterSqlite3(asIScriptEngine* engine) {
 	engine->RegisterObjectMethod(_O("sqlite3"), _O("int64 get_rows_changed() property"), asMETHOD(sqlite3DB, get_rows_changed), asCALL_THISCALL);
 	engine->RegisterObjectMethod(_O("sqlite3"), _O("int64 get_total_rows_changed() property"), asMETHOD(sqlite3DB, get_total_rows_changed), asCALL_THISCALL);
 	engine->RegisterObjectMethod(_O("sqlite3"), _O("int limit(int id, int val)"), asMETHOD(sqlite3DB, limit), asCALL_THISCALL);
-	engine->RegisterObjectMethod(_O("sqlite3"), _O("int set_authorizer(sqlite3authorizer@, const string&in=\"\")"), asMETHOD(sqlite3DB, set_authorizer), asCALL_THISCALL);
+	engine->RegisterObjectMethod(_O("sqlite3"), _O("int set_authorizer(sqlite3authorizer@, const string&in=\"\", bool cache_decisions = false)"), asMETHOD(sqlite3DB, set_authorizer), asCALL_THISCALL);
+	engine->RegisterObjectMethod(_O("sqlite3"), _O("void clear_authorizer_cache()"), asMETHOD(sqlite3DB, clear_authorizer_cache), asCALL_THISCALL);
+	engine->RegisterObjectMethod(_O("sqlite3"), _O("int create_function(const string&in name, int argc, sqlite3function@ func, int flags = 0, const string&in user_data = \"\")"), asMETHOD(sqlite3DB, create_function), asCALL_THISCALL);
+	engine->RegisterObjectMethod(_O("sqlite3"), _O("int create_aggregate(const string&in name, int argc, sqlite3aggregate_step@ step, sqlite3aggregate_final@ final, int flags = 0, const string&in user_data = \"\")"), asMETHOD(sqlite3DB, create_aggregate), asCALL_THISCALL);
+	engine->RegisterObjectMethod(_O("sqlite3"), _O("int get_statement_cache_capacity() property"), asMETHOD(sqlite3DB, get_statement_cache_capacity), asCALL_THISCALL);
+	engine->RegisterObjectMethod(_O("sqlite3"), _O("void set_statement_cache_capacity(int) property"), asMETHOD(sqlite3DB, set_statement_cache_capacity), asCALL_THISCALL);
+	engine->RegisterObjectMethod(_O("sqlite3"), _O("int get_statement_cache_size() property"), asMETHOD(sqlite3DB, get_statement_cache_size), asCALL_THISCALL);
+	engine->RegisterObjectMethod(_O("sqlite3"), _O("int64 get_statement_cache_hits() property"), asMETHOD(sqlite3DB, get_statement_cache_hits), asCALL_THISCALL);
+	engine->RegisterObjectMethod(_O("sqlite3"), _O("int64 get_statement_cache_misses() property"), asMETHOD(sqlite3DB, get_statement_cache_misses), asCALL_THISCALL);
+	engine->RegisterObjectMethod(_O("sqlite3"), _O("void clear_statement_cache()"), asMETHOD(sqlite3DB, clear_statement_cache), asCALL_THISCALL);
 	engine->RegisterObjectMethod(_O("sqlite3"), _O("int64 get_last_insert_rowid() property"), asMETHOD(sqlite3DB, get_last_insert_rowid), asCALL_THISCALL);
 	engine->RegisterObjectMethod(_O("sqlite3"), _O("void set_last_insert_rowid(int64) property"), asMETHOD(sqlite3DB, set_last_insert_rowid), asCALL_THISCALL);
 	engine->RegisterObjectMethod(_O("sqlite3"), _O("int get_last_error()"), asMETHOD(sqlite3DB, get_last_error), asCALL_THISCALL);
@@ -11,15 +11,20 @@
 */
 
 #pragma once
+#include <list>
 #include <string>
+#include <unordered_map>
 #include "../../src/nvgt_plugin.h"
 #include <scriptarray.h>
+#include <scriptdictionary.h>
 #include "sqlite3.h"
 #include "sqlite3exts.h"
 
 class sqlite3DB;
 class sqlite3statement {
+	friend class sqlite3DB;
 	int ref_count;
+	bool cached; // Also referenced by its connection's statement cache.
 public:
 	sqlite3_stmt* statement;
 	sqlite3statement(sqlite3_stmt* s);
@@ -49,10 +54,21 @@ public:
 	std::string column_name(int index);
 	int column_type(int index);
 	std::string column_text(int index);
+	// Steps once and, on SQLITE_ROW, converts column c only into the array types[c] selects: ints for SQLITE_INTEGER, doubles for SQLITE_FLOAT, strings for SQLITE_TEXT or SQLITE_BLOB. Each array is resized to the number of columns routed to it, in column order; other columns are skipped.
+	int step_into(CScriptArray* types, CScriptArray* ints = NULL, CScriptArray* doubles = NULL, CScriptArray* strings = NULL);
+	// Steps through up to max_rows rows (all when max_rows <= 0), routing columns as step_into does so that an array taking w columns holds row r at indexes r * w onwards. Returns the number of rows fetched, or a negated SQLite error code.
+	int fetch_all(CScriptArray* types, int max_rows = 0, CScriptArray* ints = NULL, CScriptArray* doubles = NULL, CScriptArray* strings = NULL);
+	// Binds and steps once per row inside a savepoint, returning the total rows changed or a negated SQLite error code, in which case nothing is kept.
+	// columns maps parameter names or 1-based indexes to equally long arrays; each entry of rows maps them to values.
+	asINT64 execute_many(CScriptDictionary* columns);
+	asINT64 execute_many(CScriptArray* rows);
 };
+class sqlite3func;
 class sqlite3context {
+	friend class sqlite3func;
 	sqlite3_context* c;
 	int ref_count;
+	const std::string* user_data;
 public:
 	sqlite3context(sqlite3_context* ctx);
 	void add_ref();
@@ -64,8 +80,10 @@ public:
 	void set_int64(asINT64 val);
 	void set_null();
 	void set_text(const std::string& text, bool transient = true);
+	std::string get_user_data();
 };
 class sqlite3value {
+	friend class sqlite3func;
 	int ref_count;
 public:
 	sqlite3_value* v;
@@ -82,9 +100,24 @@ public:
 };
 class sqlite3DB {
 	int ref_count;
+	struct statement_cache_entry {
+		std::string sql;
+		sqlite3statement* statement;
+		int tail;
+	};
+	std::list<statement_cache_entry> statement_cache; // Most recently used first.
+	std::unordered_map<std::string, std::list<statement_cache_entry>::iterator> statement_cache_index;
+	int statement_cache_capacity;
+	asINT64 statement_cache_hits, statement_cache_misses;
+	void trim_statement_cache();
 public:
 	asIScriptFunction* authorizer;
 	std::string authorizer_user_data;
+	asIScriptContext* authorizer_context;
+	std::string authorizer_args[4];
+	bool authorizer_cache_decisions;
+	std::string authorizer_key;
+	std::unordered_map<std::string, int> authorizer_cache;
 	sqlite3* db;
 	sqlite3DB();
 	sqlite3DB(const std::string& filename, int mode = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
@@ -97,7 +130,19 @@ public:
 	asINT64 get_rows_changed();
 	asINT64 get_total_rows_changed();
 	int limit(int id, int val);
-	int set_authorizer(asIScriptFunction* auth, const std::string& user_data = "");
+	// With cache_decisions, the authorizer is called once per distinct action and arguments and must answer the same way each time; clear_authorizer_cache forgets those answers.
+	int set_authorizer(asIScriptFunction* auth, const std::string& user_data = "", bool cache_decisions = false);
+	void clear_authorizer_cache();
+	// prepare hands back an idle statement compiled earlier from identical SQL, reset and with its bindings cleared, keeping up to statement_cache_capacity of them (0 disables the cache).
+	int get_statement_cache_capacity() { return statement_cache_capacity; }
+	void set_statement_cache_capacity(int capacity);
+	int get_statement_cache_size() { return statement_cache.size(); }
+	asINT64 get_statement_cache_hits() { return statement_cache_hits; }
+	asINT64 get_statement_cache_misses() { return statement_cache_misses; }
+	void clear_statement_cache();
+	// Registers a script function or aggregate on this connection, or removes it when passed null. flags may include SQLITE_DETERMINISTIC so SQLite can factor constant calls out of a query.
+	int create_function(const std::string& name, int argc, asIScriptFunction* func, int flags = 0, const std::string& user_data = "");
+	int create_aggregate(const std::string& name, int argc, asIScriptFunction* step, asIScriptFunction* final, int flags = 0, const std::string& user_data = "");
 	asINT64 get_last_insert_rowid();
 	void set_last_insert_rowid(asINT64 val);
 	int get_last_error();
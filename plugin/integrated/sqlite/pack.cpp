@@ -13,6 +13,7 @@
 #define NVGT_PLUGIN_INCLUDE
 #include "../../src/nvgt_plugin.h"
 #include "pack.h"
+#include "pack_codec.h"
 #include "sqlite3.h"
 #include <cstdint>
 #include <stdexcept>
@@ -23,8 +24,21 @@
 #include <Poco/StreamUtil.h>
 #include <algorithm>
 #include <Poco/RegularExpression.h>
+#include <Poco/SharedMemory.h>
+#include <Poco/File.h>
+#include <Poco/Exception.h>
 #include <type_traits>
 #include <array>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <optional>
+#include <chrono>
+#include <cstring>
+#include <cctype>
+#include <unordered_set>
 
 using namespace std;
 
@@ -52,18 +66,34 @@ static string column_string(sqlite3_stmt* stmt, int col) {
 	return string(reinterpret_cast<const char*>(sqlite3_column_text(stmt, col)), sqlite3_column_bytes(stmt, col));
 }
 
-static sqlite3_stmt* prepare_stmt(sqlite3* db, const char* sql) {
+static sqlite3_stmt* prepare_stmt(sqlite3* db, const char* sql, unsigned int flags = 0) {
 	sqlite3_stmt* stmt;
-	if (const auto rc = sqlite3_prepare_v3(db, sql, -1, 0, &stmt, nullptr); rc != SQLITE_OK)
+	if (const auto rc = sqlite3_prepare_v3(db, sql, -1, flags, &stmt, nullptr); rc != SQLITE_OK)
 		throw runtime_error(Poco::format("Internal error: %s", string(sqlite3_errmsg(db))));
 	return stmt;
 }
 
+// Finalizes a one-off statement, or resets a cached one so it can be rebound, when leaving scope. Helpers below never finalize on their own so that they work with both.
+class stmt_guard {
+	sqlite3_stmt* stmt;
+	bool cached;
+public:
+	stmt_guard(sqlite3_stmt* s, bool c = false) : stmt(s), cached(c) {}
+	stmt_guard(const stmt_guard&) = delete;
+	stmt_guard& operator=(const stmt_guard&) = delete;
+	~stmt_guard() {
+		if (!cached) sqlite3_finalize(stmt);
+		else {
+			sqlite3_reset(stmt);
+			sqlite3_clear_bindings(stmt);
+		}
+	}
+	operator sqlite3_stmt*() const { return stmt; }
+};
+
 static void bind_text(sqlite3* db, sqlite3_stmt* stmt, int idx, const string& s) {
-	if (const auto rc = sqlite3_bind_text64(stmt, idx, s.data(), s.size(), SQLITE_STATIC, SQLITE_UTF8); rc != SQLITE_OK) {
-		sqlite3_finalize(stmt);
+	if (const auto rc = sqlite3_bind_text64(stmt, idx, s.data(), s.size(), SQLITE_STATIC, SQLITE_UTF8); rc != SQLITE_OK)
 		throw runtime_error(Poco::format("Internal error: %s", string(sqlite3_errmsg(db))));
-	}
 }
 
 template<typename Fn>
@@ -77,62 +107,160 @@ static void query_rows(sqlite3* db, sqlite3_stmt* stmt, Fn&& on_row) {
 			sqlite3_reset(stmt);
 			continue;
 		}
-		sqlite3_finalize(stmt);
 		throw runtime_error(Poco::format("Internal error: %s", string(sqlite3_errmsg(db))));
 	}
-	sqlite3_finalize(stmt);
 }
 
-static void setup_db_write(sqlite3* db, const string& key) {
+// Moves with every commit made on the connection, and with those of other connections once it next starts reading.
+static unsigned int data_version(sqlite3* db) {
+	unsigned int version = 0;
+	sqlite3_file_control(db, "main", SQLITE_FCNTL_DATA_VERSION, &version);
+	return version;
+}
+
+static bool table_has_column(sqlite3* db, const char* table, const char* column, const char* schema = "main") {
+	stmt_guard stmt(prepare_stmt(db, "select 1 from pragma_table_info(?, ?) where name = ?"));
+	sqlite3_bind_text(stmt, 1, table, -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 2, schema, -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 3, column, -1, SQLITE_STATIC);
+	bool found = false;
+	query_rows(db, stmt, [&](sqlite3_stmt*) { found = true; });
+	return found;
+}
+
+// Pragmas each PackProfile applies. Zero, negative or null fields leave SQLite's setting alone.
+struct profile_settings {
+	int page_size; // Only takes effect when the pack is created.
+	int64_t mmap_size;
+	int cache_kb;
+	const char* synchronous;
+	const char* temp_store;
+	bool exclusive;
+	int wal_autocheckpoint; // In pages; 0 turns automatic checkpoints off.
+};
+
+static const profile_settings& get_profile_settings(const PackProfile profile) {
+	static const profile_settings defaults{0, 256 * 1024 * 1024, 4096, nullptr, nullptr, false, -1};
+	// Few large pages and a wide map for long sequential reads; the cache stays small as streamed data is rarely read twice.
+	static const profile_settings streaming{65536, 1024 * 1024 * 1024, 2048, "normal", nullptr, false, -1};
+	// Small pages waste less on each lookup and a large cache keeps the hot set of b-tree pages resident.
+	static const profile_settings random_small{4096, 256 * 1024 * 1024, 16384, "normal", "memory", false, -1};
+	// Exclusive locking lets WAL skip its shared memory index, and checkpoints wait for close.
+	static const profile_settings bulk_build{65536, 0, 65536, "off", "memory", true, 0};
+	switch (profile) {
+		case PackProfile::Streaming: return streaming;
+		case PackProfile::RandomSmall: return random_small;
+		case PackProfile::BulkBuild: return bulk_build;
+		default: return defaults;
+	}
+}
+
+// page_size and locking_mode must precede the switch to WAL, so these run first.
+static void apply_profile_layout(sqlite3* db, const PackProfile profile, const bool writable) {
+	const auto& settings = get_profile_settings(profile);
+	// Read-only connections never lock exclusively, which would keep the writer from checkpointing.
+	if (!writable) return;
+	if (settings.page_size > 0) sqlite3_exec(db, Poco::format("pragma page_size=%d;", settings.page_size).c_str(), nullptr, nullptr, nullptr);
+	if (settings.exclusive) sqlite3_exec(db, "pragma locking_mode=exclusive;", nullptr, nullptr, nullptr);
+}
+
+static void apply_profile_tuning(sqlite3* db, const PackProfile profile, const bool writable) {
+	const auto& settings = get_profile_settings(profile);
+	// mmap maps the file into the virtual address space — reads become memory accesses
+	// shared across all connections to the same file via OS page cache
+	sqlite3_exec(db, ("pragma mmap_size=" + to_string(settings.mmap_size) + ";").c_str(), nullptr, nullptr, nullptr);
+	if (settings.cache_kb > 0) sqlite3_exec(db, Poco::format("pragma cache_size=-%d;", settings.cache_kb).c_str(), nullptr, nullptr, nullptr);
+	if (settings.temp_store) sqlite3_exec(db, Poco::format("pragma temp_store=%s;", string(settings.temp_store)).c_str(), nullptr, nullptr, nullptr);
+	if (!writable) return;
+	if (settings.synchronous) sqlite3_exec(db, Poco::format("pragma synchronous=%s;", string(settings.synchronous)).c_str(), nullptr, nullptr, nullptr);
+	if (settings.wal_autocheckpoint >= 0) sqlite3_wal_autocheckpoint(db, settings.wal_autocheckpoint);
+}
+
+static constexpr const char* PACK_FILES_COLUMNS = "file_name primary key not null unique, data, codec integer not null default 0, size integer, frames blob, content integer";
+static constexpr const char* PACK_CONTENT_COLUMNS = "id integer primary key, hash integer not null, data, codec integer not null default 0, size integer, frames blob, refs integer not null default 0";
+
+// Creates or upgrades the pack tables with their indexes and triggers. Safe to run again, as optimize does after rebuilding the tables.
+static void create_pack_schema(sqlite3* db) {
+	if (const auto rc = sqlite3_exec(db, Poco::format("create table if not exists pack_files(%s); create unique index if not exists pack_files_index on pack_files(file_name);", string(PACK_FILES_COLUMNS)).c_str(), nullptr, nullptr, nullptr); rc != SQLITE_OK)
+		throw runtime_error(Poco::format("Internal error: could not create table or index: %s", string(sqlite3_errmsg(db))));
+	// Packs created before entries could be compressed lack the codec columns, and those from before deduplication the content column.
+	if (!table_has_column(db, "pack_files", "codec")) {
+		if (const auto rc = sqlite3_exec(db, "alter table pack_files add column codec integer not null default 0; alter table pack_files add column size integer; alter table pack_files add column frames blob;", nullptr, nullptr, nullptr); rc != SQLITE_OK)
+			throw runtime_error(Poco::format("Internal error: could not upgrade pack table: %s", string(sqlite3_errmsg(db))));
+	}
+	if (!table_has_column(db, "pack_files", "content")) {
+		if (const auto rc = sqlite3_exec(db, "alter table pack_files add column content integer;", nullptr, nullptr, nullptr); rc != SQLITE_OK)
+			throw runtime_error(Poco::format("Internal error: could not upgrade pack table: %s", string(sqlite3_errmsg(db))));
+	}
+	// Deduplicated bytes live in pack_content, counted by the pack_files rows that reference them. Recursive triggers make rows dropped by insert or replace release their content too.
+	if (const auto rc = sqlite3_exec(db, Poco::format("pragma recursive_triggers = on;"
+		"create table if not exists pack_content(%s);"
+		"create index if not exists pack_content_hash on pack_content(hash);"
+		"create trigger if not exists pack_content_ref after insert on pack_files when new.content is not null begin update pack_content set refs = refs + 1 where id = new.content; end;"
+		"create trigger if not exists pack_content_unref after delete on pack_files when old.content is not null begin update pack_content set refs = refs - 1 where id = old.content; delete from pack_content where id = old.content and refs <= 0; end;", string(PACK_CONTENT_COLUMNS)).c_str(), nullptr, nullptr, nullptr); rc != SQLITE_OK)
+		throw runtime_error(Poco::format("Internal error: could not create content table: %s", string(sqlite3_errmsg(db))));
+	// sync_directory records the source file behind each entry it writes. Rows go with their entry when it is deleted, replaced or renamed.
+	if (const auto rc = sqlite3_exec(db, "create table if not exists pack_manifest(file_name primary key not null, mtime integer not null, size integer not null, hash integer not null);"
+		"create trigger if not exists pack_manifest_delete after delete on pack_files begin delete from pack_manifest where file_name = old.file_name; end;"
+		"create trigger if not exists pack_manifest_rename after update of file_name on pack_files begin delete from pack_manifest where file_name = old.file_name; end;", nullptr, nullptr, nullptr); rc != SQLITE_OK)
+		throw runtime_error(Poco::format("Internal error: could not create manifest table: %s", string(sqlite3_errmsg(db))));
+}
+
+static void setup_db_write(sqlite3* db, const string& key, const PackProfile profile = PackProfile::Default) {
 	sqlite3_db_config(db, SQLITE_DBCONFIG_LOOKASIDE, nullptr, 128, 500);
 	if (!key.empty()) {
 		if (const auto rc = sqlite3_key_v2(db, "main", key.data(), key.size()); rc != SQLITE_OK)
 			throw runtime_error(Poco::format("Internal error: Could not set key: %s", string(sqlite3_errmsg(db))));
 	}
+	apply_profile_layout(db, profile, true);
 	if (const auto rc = sqlite3_exec(db, "pragma journal_mode=wal;", nullptr, nullptr, nullptr); rc != SQLITE_OK)
 		throw runtime_error(Poco::format("Internal error: could not set journaling mode: %s", string(sqlite3_errmsg(db))));
-	if (const auto rc = sqlite3_exec(db, "create table if not exists pack_files(file_name primary key not null unique, data); create unique index if not exists pack_files_index on pack_files(file_name);", nullptr, nullptr, nullptr); rc != SQLITE_OK)
-		throw runtime_error(Poco::format("Internal error: could not create table or index: %s", string(sqlite3_errmsg(db))));
+	apply_profile_tuning(db, profile, true);
+	create_pack_schema(db);
 	if (const auto rc = sqlite3_db_config(db, SQLITE_DBCONFIG_DEFENSIVE, 1, NULL); rc != SQLITE_OK)
 		throw runtime_error(Poco::format("Internal error: culd not set defensive mode: %s", string(sqlite3_errmsg(db))));
 	if (const auto rc = sqlite3_create_function_v2(db, "regexp", 2, SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_DIRECTONLY, nullptr, &regexp, nullptr, nullptr, nullptr); rc != SQLITE_OK)
 		throw runtime_error(Poco::format("Internal error: Could not register regexp function: %s", string(sqlite3_errmsg(db))));
 }
 
-static void setup_db_read(sqlite3* db, const string& key) {
+static void setup_db_read(sqlite3* db, const string& key, const PackProfile profile = PackProfile::Default) {
 	sqlite3_db_config(db, SQLITE_DBCONFIG_LOOKASIDE, nullptr, 128, 500);
 	if (!key.empty()) {
 		if (const auto rc = sqlite3_key_v2(db, "main", key.data(), key.size()); rc != SQLITE_OK)
 			throw runtime_error(Poco::format("Internal error: Could not set key: %s", string(sqlite3_errmsg(db))));
 	}
-	// mmap maps the file into the virtual address space — reads become memory accesses
-	// shared across all connections to the same file via OS page cache
-	sqlite3_exec(db, "pragma mmap_size=268435456;", nullptr, nullptr, nullptr);
-	sqlite3_exec(db, "pragma cache_size=-4096;", nullptr, nullptr, nullptr);
+	apply_profile_layout(db, profile, false);
+	apply_profile_tuning(db, profile, false);
 	if (const auto rc = sqlite3_create_function_v2(db, "regexp", 2, SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_DIRECTONLY, nullptr, &regexp, nullptr, nullptr, nullptr); rc != SQLITE_OK)
 		throw runtime_error(Poco::format("Internal error: Could not register regexp function: %s", string(sqlite3_errmsg(db))));
 }
 
-// Returns the rowid of the newly inserted row
-static int64_t insert_blob_from_stream(sqlite3* db, const string& pack_filename, istream& src, uint64_t stream_size) {
-	auto stmt = prepare_stmt(db, "insert into pack_files values(?, ?)");
-	bind_text(db, stmt, 1, pack_filename);
-	if (const auto rc = sqlite3_bind_zeroblob64(stmt, 2, stream_size); rc != SQLITE_OK) {
-		sqlite3_finalize(stmt);
+static constexpr const char* INSERT_FILE_SQL = "insert into pack_files(file_name, data) values(?, ?)";
+static constexpr const char* INSERT_COMPRESSED_SQL = "insert into pack_files(file_name, data, codec, size, frames) values(?, ?, ?, ?, ?)";
+static constexpr const char* INSERT_CONTENT_SQL = "insert into pack_content(hash, data) values(?, ?)";
+static constexpr const char* INSERT_COMPRESSED_CONTENT_SQL = "insert into pack_content(hash, data, codec, size, frames) values(?, ?, ?, ?, ?)";
+static constexpr const char* INSERT_LINK_SQL = "insert into pack_files(file_name, content) values(?, ?)";
+
+// The insert helpers below bind parameter 2 onwards; the caller binds the key in parameter 1, a file name for pack_files or a hash for pack_content.
+
+// Returns the rowid of the newly inserted row. stmt must be a prepared INSERT_FILE_SQL or INSERT_CONTENT_SQL inserting into table.
+static int64_t insert_blob_from_stream(sqlite3* db, sqlite3_stmt* stmt, const char* table, istream& src, uint64_t stream_size, size_t buffer_size) {
+	if (stream_size > SQLITE_MAX_LENGTH) throw runtime_error("Entry exceeds the maximum blob size");
+	if (const auto rc = sqlite3_bind_zeroblob64(stmt, 2, stream_size); rc != SQLITE_OK)
 		throw runtime_error(Poco::format("Internal error: %s", string(sqlite3_errmsg(db))));
-	}
 	query_rows(db, stmt, [](sqlite3_stmt*) {});
 	const int64_t rowid = sqlite3_last_insert_rowid(db);
 	sqlite3_blob* blob;
-	if (const auto rc = sqlite3_blob_open(db, "main", "pack_files", "data", rowid, 1, &blob); rc != SQLITE_OK)
+	if (const auto rc = sqlite3_blob_open(db, "main", table, "data", rowid, 1, &blob); rc != SQLITE_OK)
 		throw runtime_error(Poco::format("Internal error: %s", string(sqlite3_errmsg(db))));
-	char buffer[4096];
-	int offset = 0;
-	while (src) {
-		src.read(buffer, 4096);
-		const auto n = static_cast<int>(src.gcount());
+	// The blob API takes int offsets, which the size check above keeps in range.
+	vector<char> buffer(static_cast<size_t>(max<uint64_t>(1, min<uint64_t>(buffer_size, stream_size))));
+	uint64_t offset = 0;
+	while (src && offset < stream_size) {
+		src.read(buffer.data(), static_cast<streamsize>(min<uint64_t>(buffer.size(), stream_size - offset)));
+		const auto n = static_cast<uint64_t>(src.gcount());
 		if (n == 0) break;
-		if (const auto rc = sqlite3_blob_write(blob, buffer, n, offset); rc != SQLITE_OK) {
+		if (const auto rc = sqlite3_blob_write(blob, buffer.data(), static_cast<int>(n), static_cast<int>(offset)); rc != SQLITE_OK) {
 			sqlite3_blob_close(blob);
 			throw runtime_error(Poco::format("Internal error: %s", string(sqlite3_errmsg(db))));
 		}
@@ -142,28 +270,166 @@ static int64_t insert_blob_from_stream(sqlite3* db, const string& pack_filename,
 	return rowid;
 }
 
-// Returns the rowid of the newly inserted row
-static int64_t insert_blob_memory(sqlite3* db, const string& pack_filename, const void* data, uint64_t size) {
-	auto stmt = prepare_stmt(db, "insert into pack_files values(?, ?)");
-	bind_text(db, stmt, 1, pack_filename);
-	if (const auto rc = sqlite3_bind_blob64(stmt, 2, data, size, SQLITE_STATIC); rc != SQLITE_OK) {
-		sqlite3_finalize(stmt);
+// Returns the rowid of the newly inserted row. stmt must be a prepared INSERT_FILE_SQL or INSERT_CONTENT_SQL.
+static int64_t insert_blob_memory(sqlite3* db, sqlite3_stmt* stmt, const void* data, uint64_t size) {
+	if (const auto rc = sqlite3_bind_blob64(stmt, 2, data, size, SQLITE_STATIC); rc != SQLITE_OK)
 		throw runtime_error(Poco::format("Internal error: %s", string(sqlite3_errmsg(db))));
-	}
 	query_rows(db, stmt, [](sqlite3_stmt*) {});
 	return sqlite3_last_insert_rowid(db);
 }
 
+// Returns the rowid of the newly inserted row. stmt must be a prepared INSERT_COMPRESSED_SQL or INSERT_COMPRESSED_CONTENT_SQL.
+static int64_t insert_blob_compressed(sqlite3* db, sqlite3_stmt* stmt, uint64_t size, const compressed_entry& entry) {
+	const string frames = entry.frames.serialize();
+	if (sqlite3_bind_blob64(stmt, 2, entry.data.data(), entry.data.size(), SQLITE_STATIC) != SQLITE_OK || sqlite3_bind_int(stmt, 3, static_cast<int>(entry.codec)) != SQLITE_OK || sqlite3_bind_int64(stmt, 4, static_cast<sqlite3_int64>(size)) != SQLITE_OK || sqlite3_bind_blob64(stmt, 5, frames.data(), frames.size(), SQLITE_STATIC) != SQLITE_OK)
+		throw runtime_error(Poco::format("Internal error: %s", string(sqlite3_errmsg(db))));
+	query_rows(db, stmt, [](sqlite3_stmt*) {});
+	return sqlite3_last_insert_rowid(db);
+}
+
+// Decodes size bytes starting at offset from a compressed entry of total uncompressed bytes. Only the frames overlapping the range are read.
+static void read_compressed(sqlite3_blob* blob, PackCodec codec, const frame_index& idx, uint64_t total, uint64_t offset, char* out, uint64_t size) {
+	string compressed, frame;
+	for (size_t f = offset / idx.get_frame_size(); size > 0; f++) {
+		if (f >= idx.frame_count() || idx.frame_end(f) < idx.frame_begin(f)) throw runtime_error("Corrupt frame index");
+		const auto begin = idx.frame_begin(f);
+		const auto compressed_len = idx.frame_end(f) - begin;
+		compressed.resize(compressed_len);
+		if (const auto rc = sqlite3_blob_read(blob, compressed.data(), static_cast<int>(compressed_len), static_cast<int>(begin)); rc != SQLITE_OK)
+			throw runtime_error(sqlite3_errstr(rc));
+		const uint64_t frame_len = idx.frame_length(f, total);
+		const uint64_t skip = offset - static_cast<uint64_t>(f) * idx.get_frame_size();
+		const uint64_t take = min(frame_len - skip, size);
+		if (skip == 0 && take == frame_len) decompress_frame(codec, compressed.data(), compressed_len, out, frame_len);
+		else {
+			frame.resize(frame_len);
+			decompress_frame(codec, compressed.data(), compressed_len, frame.data(), frame_len);
+			memcpy(out, frame.data() + skip, take);
+		}
+		out += take;
+		offset += take;
+		size -= take;
+	}
+}
+
+// Raw entries are copied to disk this many bytes at a time; compressed ones a frame at a time.
+static constexpr size_t EXTRACT_BUFFER_SIZE = 1024 * 1024;
+
+namespace {
+// Reads whole entries through one connection, to memory or to disk, keeping a blob handle per data table open and moving it between rows with sqlite3_blob_reopen.
+class entry_reader {
+	sqlite3* db;
+	sqlite3_blob* blobs[2] = {nullptr, nullptr};
+	sqlite3_stmt* frames_stmts[2] = {nullptr, nullptr};
+	vector<char> buffer;
+	sqlite3_blob* open_blob(const pack_entry& entry) {
+		sqlite3_blob*& blob = blobs[entry.content ? 1 : 0];
+		if (blob && sqlite3_blob_reopen(blob, entry.data_rowid()) == SQLITE_OK) return blob;
+		if (blob) sqlite3_blob_close(blob);
+		blob = nullptr;
+		if (const auto rc = sqlite3_blob_open(db, "main", entry.data_table(), "data", entry.data_rowid(), 0, &blob); rc != SQLITE_OK) {
+			sqlite3_blob_close(blob);
+			blob = nullptr;
+			throw runtime_error(Poco::format("Internal error: %s", string(sqlite3_errmsg(db))));
+		}
+		return blob;
+	}
+	frame_index read_frames(const pack_entry& entry) {
+		sqlite3_stmt*& stmt = frames_stmts[entry.content ? 1 : 0];
+		if (!stmt) stmt = prepare_stmt(db, entry.content ? "select frames from pack_content where id = ?" : "select frames from pack_files where rowid = ?", SQLITE_PREPARE_PERSISTENT);
+		stmt_guard guard(stmt, true);
+		sqlite3_bind_int64(stmt, 1, entry.data_rowid());
+		optional<frame_index> idx;
+		query_rows(db, stmt, [&](sqlite3_stmt* s) { idx = frame_index::parse(sqlite3_column_blob(s, 0), sqlite3_column_bytes(s, 0)); });
+		if (!idx) throw runtime_error(Poco::format("Missing frame index for %s", string(entry.name)));
+		return *idx;
+	}
+public:
+	explicit entry_reader(sqlite3* connection) : db(connection) {}
+	entry_reader(const entry_reader&) = delete;
+	entry_reader& operator=(const entry_reader&) = delete;
+	~entry_reader() {
+		for (auto blob : blobs) sqlite3_blob_close(blob);
+		for (auto stmt : frames_stmts) sqlite3_finalize(stmt);
+	}
+	shared_ptr<const frame_index> get_frame_index(const pack_entry& entry) {
+		return make_shared<const frame_index>(read_frames(entry));
+	}
+	// dst must hold entry.size bytes.
+	void read(const pack_entry& entry, void* dst) {
+		if (entry.size == 0) return;
+		sqlite3_blob* blob = open_blob(entry);
+		if (entry.codec == PackCodec::None) {
+			if (const auto rc = sqlite3_blob_read(blob, dst, static_cast<int>(entry.size), 0); rc != SQLITE_OK)
+				throw runtime_error(Poco::format("Internal error: %s", string(sqlite3_errmsg(db))));
+		} else read_compressed(blob, entry.codec, read_frames(entry), entry.size, 0, static_cast<char*>(dst), entry.size);
+	}
+	bool extract(const pack_entry& entry, const string& file_on_disk) {
+		ofstream stream(file_on_disk, ios::out | ios::binary);
+		if (!stream) return false;
+		if (entry.size == 0) return true;
+		if (buffer.size() < EXTRACT_BUFFER_SIZE) buffer.resize(EXTRACT_BUFFER_SIZE);
+		sqlite3_blob* blob = open_blob(entry);
+		if (entry.codec == PackCodec::None) {
+			for (uint64_t offset = 0; offset < entry.size;) {
+				const auto chunk = static_cast<int>(min<uint64_t>(buffer.size(), entry.size - offset));
+				if (const auto rc = sqlite3_blob_read(blob, buffer.data(), chunk, static_cast<int>(offset)); rc != SQLITE_OK)
+					throw runtime_error(Poco::format("Internal error: %s", string(sqlite3_errmsg(db))));
+				stream.write(buffer.data(), chunk);
+				offset += chunk;
+			}
+		} else {
+			const auto idx = read_frames(entry);
+			if (buffer.size() < idx.get_frame_size()) buffer.resize(idx.get_frame_size());
+			for (size_t f = 0; f < idx.frame_count(); f++) {
+				const auto length = idx.frame_length(f, entry.size);
+				read_compressed(blob, entry.codec, idx, entry.size, static_cast<uint64_t>(f) * idx.get_frame_size(), buffer.data(), length);
+				stream.write(buffer.data(), length);
+			}
+		}
+		return !stream.bad() && !stream.fail();
+	}
+};
+}
+
+// Adapts a script progress callback for native code. The result must only be invoked from the thread running the script.
+static pack::progress_callback script_progress_callback(asIScriptFunction* func) {
+	if (!func) return nullptr;
+	return [func](const string& name, uint64_t done, uint64_t total) {
+		asIScriptEngine* engine = func->GetEngine();
+		asIScriptContext* ctx = engine->RequestContext();
+		if (!ctx) return;
+		if (ctx->Prepare(func) >= 0) {
+			ctx->SetArgObject(0, const_cast<string*>(&name));
+			ctx->SetArgQWord(1, done);
+			ctx->SetArgQWord(2, total);
+			ctx->Execute();
+		}
+		engine->ReturnContext(ctx);
+	};
+}
+
 // --- pack ---
 
-pack::pack() : db(nullptr), created_from_copy(false), mutable_origin(nullptr) {
+// Read blob handles each pack keeps open between reads.
+static constexpr size_t BLOB_POOL_SIZE = 4;
+// get_file hands out mapped views only when asked to. A view of an entry that spills onto overflow pages is a private copy assembled up front, which costs more than streaming it.
+static constexpr uint64_t DEFAULT_MAPPED_VIEW_LIMIT = 0;
+static constexpr uint64_t DEFAULT_PREFETCH_CACHE_LIMIT = 64 * 1024 * 1024;
+static constexpr unsigned int DEFAULT_PREFETCH_THREADS = 2;
+static constexpr uint64_t DEFAULT_FILE_CACHE_LIMIT = 8 * 1024 * 1024;
+static constexpr uint64_t DEFAULT_IMPORT_BUFFER_SIZE = 1024 * 1024;
+// Files smaller than this are cheaper to read into a buffer than to map.
+static constexpr uint64_t IMPORT_MAP_MIN = 256 * 1024;
+
+pack::pack() : db(nullptr), created_from_copy(false), mutable_origin(nullptr), mapped_view_limit(DEFAULT_MAPPED_VIEW_LIMIT), compression(PackCodec::None), compression_level(-1), compression_frame_size(DEFAULT_PACK_FRAME_SIZE), has_codec_columns(false), profile(PackProfile::Default), deduplicate(false), import_buffer_size(DEFAULT_IMPORT_BUFFER_SIZE), map_imports(true), stmt_cache_hits(0), stmt_cache_misses(0), blob_clock(0), blob_opens(0), blob_reopens(0), blob_reuses(0), prefetch_cache_limit(DEFAULT_PREFETCH_CACHE_LIMIT), prefetch_threads(DEFAULT_PREFETCH_THREADS), read_pool_size(0), trace_access(false), file_cache(make_shared<entry_lru>(DEFAULT_FILE_CACHE_LIMIT)), rowid_epoch(make_shared<atomic<uint64_t>>(0)), loaded_rowid_epoch(0) {
 	call_once(SQLITE3MC_INITIALIZER, []() {
 		sqlite3_initialize();
 		CScriptArray::SetMemoryFunctions(std::malloc, std::free);
 	});
 }
 
-pack::pack(const pack& other) : db(nullptr), created_from_copy(false), mutable_origin(&other) {
+pack::pack(const pack& other) : db(nullptr), created_from_copy(false), mutable_origin(&other), mapped_view_limit(other.mapped_view_limit), compression(other.compression), compression_level(other.compression_level), compression_frame_size(other.compression_frame_size), has_codec_columns(false), profile(other.profile), deduplicate(other.deduplicate), import_buffer_size(other.import_buffer_size), map_imports(other.map_imports), stmt_cache_hits(0), stmt_cache_misses(0), blob_clock(0), blob_opens(0), blob_reopens(0), blob_reuses(0), prefetch_cache_limit(other.prefetch_cache_limit), prefetch_threads(other.prefetch_threads), read_pool_size(other.read_pool_size), trace_access(other.trace_access), file_cache(other.file_cache), rowid_epoch(other.rowid_epoch), loaded_rowid_epoch(*other.rowid_epoch) {
 	const auto dbptr = other.get_db_ptr();
 	const auto filename = sqlite3_filename_database(sqlite3_db_filename(dbptr, "main"));
 	if (!filename) throw runtime_error("Cannot create a read-only copy of an in-memory or temporary pack!");
@@ -172,30 +438,306 @@ pack::pack(const pack& other) : db(nullptr), created_from_copy(false), mutable_o
 	created_from_copy = true;
 }
 
-void pack::load_entry_cache() const {
+// --- entry_table ---
+
+namespace {
+	constexpr size_t ENTRY_ARENA_BLOCK = 64 * 1024;
+	constexpr uint32_t EMPTY_SLOT = 0, DEAD_SLOT = UINT32_MAX;
+	constexpr size_t NO_SLOT = SIZE_MAX;
+	size_t hash_name(const string_view name) { return hash<string_view>{}(name); }
+	// std::hash is the identity for integers on common implementations, which clusters badly with linear probing.
+	size_t hash_rowid(const int64_t rowid) {
+		uint64_t x = static_cast<uint64_t>(rowid);
+		x ^= x >> 33;
+		x *= 0xff51afd7ed558ccdULL;
+		x ^= x >> 33;
+		return static_cast<size_t>(x);
+	}
+}
+
+string_view entry_table::intern(const string_view name) {
+	if (arena.empty() || arena_block_used + name.size() > arena_block_size) {
+		arena_block_size = max(ENTRY_ARENA_BLOCK, name.size());
+		arena.emplace_back(new char[arena_block_size]);
+		arena_block_used = 0;
+		arena_bytes += arena_block_size;
+	}
+	char* dst = arena.back().get() + arena_block_used;
+	if (!name.empty()) memcpy(dst, name.data(), name.size());
+	arena_block_used += name.size();
+	name_bytes += name.size();
+	return string_view(dst, name.size());
+}
+
+size_t entry_table::find_name_slot(const string_view name) const {
+	if (name_slots.empty()) return NO_SLOT;
+	const size_t mask = name_slots.size() - 1;
+	for (size_t i = hash_name(name) & mask;; i = (i + 1) & mask) {
+		const uint32_t slot = name_slots[i];
+		if (slot == EMPTY_SLOT) return NO_SLOT;
+		if (slot != DEAD_SLOT && records[slot - 1].name == name) return i;
+	}
+}
+
+size_t entry_table::find_rowid_slot(const int64_t rowid, const uint32_t index) const {
+	if (rowid_slots.empty()) return NO_SLOT;
+	const size_t mask = rowid_slots.size() - 1;
+	for (size_t i = hash_rowid(rowid) & mask;; i = (i + 1) & mask) {
+		const uint32_t slot = rowid_slots[i];
+		if (slot == EMPTY_SLOT) return NO_SLOT;
+		if (slot != DEAD_SLOT && (index ? slot == index : records[slot - 1].rowid == rowid)) return i;
+	}
+}
+
+void entry_table::link(const uint32_t index) {
+	const pack_entry& entry = records[index - 1];
+	const size_t mask = name_slots.size() - 1;
+	size_t i = hash_name(entry.name) & mask;
+	while (name_slots[i] != EMPTY_SLOT && name_slots[i] != DEAD_SLOT) i = (i + 1) & mask;
+	name_slots[i] = index;
+	i = hash_rowid(entry.rowid) & mask;
+	while (rowid_slots[i] != EMPTY_SLOT && rowid_slots[i] != DEAD_SLOT) i = (i + 1) & mask;
+	rowid_slots[i] = index;
+}
+
+void entry_table::rebuild(const size_t capacity) {
+	if (records.size() != live) {
+		// Drop erased records and repack the surviving names into a fresh arena.
+		vector<pack_entry> old = std::move(records);
+		const auto old_arena = std::move(arena);
+		records.clear();
+		records.reserve(live);
+		arena.clear();
+		arena_block_used = arena_block_size = 0;
+		arena_bytes = name_bytes = 0;
+		for (const auto& entry : old) {
+			if (!entry.name.data()) continue;
+			records.push_back(entry);
+			records.back().name = intern(entry.name);
+		}
+		sorted.clear();
+		sorted_dirty = live > 0;
+	}
+	name_slots.assign(capacity, EMPTY_SLOT);
+	rowid_slots.assign(capacity, EMPTY_SLOT);
+	for (uint32_t i = 1; i <= records.size(); i++) link(i);
+}
+
+const pack_entry* entry_table::find(const string_view name) const {
+	const size_t slot = find_name_slot(name);
+	return slot != NO_SLOT ? &records[name_slots[slot] - 1] : nullptr;
+}
+
+const pack_entry* entry_table::find_rowid(const int64_t rowid) const {
+	const size_t slot = find_rowid_slot(rowid, 0);
+	return slot != NO_SLOT ? &records[rowid_slots[slot] - 1] : nullptr;
+}
+
+void entry_table::put(const pack_entry& entry) {
+	// Replacing a record in place would leave a rowid tombstone the load check below never counts, so callers erase the old name first.
+	if (find_name_slot(entry.name) != NO_SLOT) throw runtime_error(Poco::format("Internal error: %s is already in the entry table", string(entry.name)));
+	// Erased records still occupy tombstones, so size the tables by every record rather than only live ones, keeping the load under 70%.
+	if ((records.size() + 1) * 10 > name_slots.size() * 7) {
+		size_t capacity = 16;
+		while ((live + 1) * 10 > capacity * 5) capacity *= 2;
+		rebuild(capacity);
+	}
+	if (records.size() >= DEAD_SLOT - 1) throw runtime_error("Too many entries in pack");
+	records.push_back(entry);
+	records.back().name = intern(entry.name);
+	live++;
+	const uint32_t index = static_cast<uint32_t>(records.size());
+	link(index);
+	// Appending in order is the common case when a directory is added, so keep the sorted index valid without a rebuild when we can.
+	const string_view name = records.back().name;
+	if (!sorted_dirty && (sorted.empty() || sorted.back() < name)) sorted.push_back(name);
+	else sorted_dirty = true;
+}
+
+void entry_table::erase(const string_view name) {
+	const size_t slot = find_name_slot(name);
+	if (slot == NO_SLOT) return;
+	const uint32_t index = name_slots[slot];
+	pack_entry& entry = records[index - 1];
+	name_slots[slot] = DEAD_SLOT;
+	rowid_slots[find_rowid_slot(entry.rowid, index)] = DEAD_SLOT;
+	name_bytes -= entry.name.size();
+	entry.name = string_view();
+	live--;
+	sorted_dirty = true;
+}
+
+void entry_table::clear() {
+	arena.clear();
+	arena_block_used = arena_block_size = 0;
+	arena_bytes = name_bytes = 0;
+	records.clear();
+	live = 0;
+	name_slots.clear();
+	rowid_slots.clear();
+	sorted.clear();
+	sorted_dirty = false;
+}
+
+uint64_t entry_table::total_size() const {
+	uint64_t total = 0;
+	for (const auto& entry : records) {
+		if (entry.name.data()) total += entry.size;
+	}
+	return total;
+}
+
+const vector<string_view>& entry_table::sorted_names() const {
+	if (sorted_dirty) {
+		sorted.clear();
+		sorted.reserve(live);
+		for (const auto& entry : records) {
+			if (entry.name.data()) sorted.push_back(entry.name);
+		}
+		ranges::sort(sorted);
+		sorted_dirty = false;
+	}
+	return sorted;
+}
+
+uint64_t entry_table::memory_usage() const {
+	return arena_bytes + records.capacity() * sizeof(pack_entry) + (name_slots.capacity() + rowid_slots.capacity()) * sizeof(uint32_t) + sorted.capacity() * sizeof(string_view);
+}
+
+// --- pack entry cache ---
+
+void pack::cache_put(const pack_entry& entry) const {
+	lock_guard lock(entry_mutex);
+	entry_cache.put(entry);
+}
+
+void pack::cache_erase(const string& name) const {
+	lock_guard lock(entry_mutex);
+	if (const auto entry = entry_cache.find(name)) frame_index_cache.erase(entry->data_key());
+	entry_cache.erase(name);
+}
+
+void pack::cache_clear() const {
+	lock_guard lock(entry_mutex);
 	entry_cache.clear();
-	auto stmt = prepare_stmt(db, "select rowid, file_name, length(data) from pack_files");
+	frame_index_cache.clear();
+}
+
+// Returns the range of sorted names starting with prefix.
+static pair<vector<string_view>::const_iterator, vector<string_view>::const_iterator> prefix_range(const vector<string_view>& names, string_view prefix) {
+	const auto first = ranges::lower_bound(names, prefix);
+	const auto last = find_if(first, names.end(), [&](string_view n) { return !n.starts_with(prefix); });
+	return {first, last};
+}
+
+// Exposes every entry as id, file_name, size, codec and content whatever generation of the schema the pack was written with, so that entry queries need only one form. Temporary objects are allowed on read-only connections.
+static void create_entry_view(sqlite3* db) {
+	const char* sql;
+	if (table_has_column(db, "pack_files", "content")) sql = "create temp view if not exists pack_entries as select f.rowid as id, f.file_name as file_name, coalesce(c.size, length(c.data), f.size, length(f.data)) as size, coalesce(c.codec, f.codec) as codec, coalesce(f.content, 0) as content from pack_files f left join pack_content c on c.id = f.content";
+	else if (table_has_column(db, "pack_files", "codec")) sql = "create temp view if not exists pack_entries as select rowid as id, file_name, coalesce(size, length(data)) as size, codec, 0 as content from pack_files";
+	else sql = "create temp view if not exists pack_entries as select rowid as id, file_name, length(data) as size, 0 as codec, 0 as content from pack_files";
+	if (const auto rc = sqlite3_exec(db, sql, nullptr, nullptr, nullptr); rc != SQLITE_OK)
+		throw runtime_error(Poco::format("Internal error: could not create entry view: %s", string(sqlite3_errmsg(db))));
+}
+
+static pack_entry column_entry(sqlite3_stmt* s, const string_view name) {
+	return pack_entry{name, static_cast<uint64_t>(sqlite3_column_int64(s, 2)), sqlite3_column_int64(s, 0), static_cast<PackCodec>(sqlite3_column_int(s, 3)), sqlite3_column_int64(s, 4)};
+}
+
+static void load_entries(sqlite3* db, entry_table& table) {
+	stmt_guard stmt(prepare_stmt(db, "select id, file_name, size, codec, content from pack_entries"));
 	query_rows(db, stmt, [&](sqlite3_stmt* s) {
-		const int64_t rowid = sqlite3_column_int64(s, 0);
-		string name = column_string(s, 1);
-		const uint64_t size = static_cast<uint64_t>(sqlite3_column_int64(s, 2));
-		entry_cache.emplace(name, pack_entry{name, size, rowid});
+		// The table interns the name, so view the column text directly rather than copying it twice.
+		const string_view name(reinterpret_cast<const char*>(sqlite3_column_text(s, 1)), sqlite3_column_bytes(s, 1));
+		table.put(column_entry(s, name));
 	});
 }
 
+void pack::load_entry_cache() const {
+	lock_guard lock(entry_mutex);
+	ensure_entry_cache();
+	cache_clear();
+	load_entries(db, entry_cache);
+}
+
+bool pack::start_lazy_entry_cache(const string& key) {
+	const auto filename = sqlite3_filename_database(sqlite3_db_filename(db, "main"));
+	if (!filename || !*filename) return false;
+	lazy_load = async(launch::async, [file = string(filename), key]() {
+		sqlite3* loader;
+		if (sqlite3_open_v2(file.c_str(), &loader, SQLITE_OPEN_READONLY | SQLITE_OPEN_EXRESCODE, nullptr) != SQLITE_OK) {
+			sqlite3_close(loader);
+			throw runtime_error("Could not open pack for loading the entry cache");
+		}
+		entry_table table;
+		try {
+			setup_db_read(loader, key);
+			create_entry_view(loader);
+			load_entries(loader, table);
+		} catch (...) {
+			sqlite3_close(loader);
+			throw;
+		}
+		sqlite3_close(loader);
+		return table;
+	});
+	return true;
+}
+
+uint64_t pack::get_entry_cache_memory() const {
+	ensure_entry_cache();
+	return entry_cache.memory_usage();
+}
+
+uint64_t pack::get_entry_cache_name_bytes() const {
+	ensure_entry_cache();
+	return entry_cache.get_name_bytes();
+}
+
+bool pack::entry_cache_ready() const {
+	lock_guard lock(entry_mutex);
+	if (!lazy_load.valid()) return true;
+	if (lazy_load.wait_for(chrono::seconds(0)) != future_status::ready) return false;
+	adopt_lazy_entry_cache();
+	return true;
+}
+
+void pack::ensure_entry_cache() const {
+	lock_guard lock(entry_mutex);
+	if (!lazy_load.valid()) return;
+	lazy_load.wait();
+	adopt_lazy_entry_cache();
+}
+
+void pack::adopt_lazy_entry_cache() const {
+	// Pending entries are left for begin_write to drop, as get_file may adopt the cache while the script thread still points at one.
+	try {
+		entry_cache = lazy_load.get();
+	} catch (exception&) {
+		// The background connection failed; the pack's own connection works, so fall back to loading on it.
+		load_entry_cache();
+	}
+}
+
 bool pack::open(const string& filename, int mode, const string& key) {
+	const bool lazy = mode & PACK_OPEN_LAZY;
+	mode &= ~PACK_OPEN_LAZY;
 	if (mode & SQLITE_OPEN_READONLY) {
 		if (const auto rc = sqlite3_open_v2(filename.c_str(), &db, SQLITE_OPEN_READONLY | SQLITE_OPEN_EXRESCODE, nullptr); rc != SQLITE_OK)
 			return false;
-		setup_db_read(db, key);
+		setup_db_read(db, key, profile);
 	} else {
 		if (const auto rc = sqlite3_open_v2(filename.data(), &db, mode | SQLITE_OPEN_EXRESCODE, nullptr); rc != SQLITE_OK)
 			return false;
-		setup_db_write(db, key);
+		setup_db_write(db, key, profile);
 	}
 	if (!key.empty()) set_key(key);
 	pack_name = filesystem::canonical(filename).string();
-	load_entry_cache();
+	has_codec_columns = table_has_column(db, "pack_files", "codec");
+	create_entry_view(db);
+	// Exclusive locking would keep the loader's connection out.
+	if (!lazy || get_profile_settings(profile).exclusive || !start_lazy_entry_cache(key)) load_entry_cache();
+	start_read_pool();
 	return true;
 }
 
@@ -207,7 +749,28 @@ bool pack::open(const string& filename, const string& key, bool rw) {
 	return open(filename, rw ? SQLITE_OPEN_READWRITE : SQLITE_OPEN_READONLY, key);
 }
 
+sqlite3_stmt* pack::cached_stmt(const char* sql) const {
+	if (const auto it = stmt_cache.find(sql); it != stmt_cache.end()) {
+		stmt_cache_hits++;
+		return it->second;
+	}
+	auto stmt = prepare_stmt(db, sql, SQLITE_PREPARE_PERSISTENT);
+	stmt_cache.emplace(sql, stmt);
+	stmt_cache_misses++;
+	return stmt;
+}
+
+void pack::finalize_stmt_cache() const {
+	for (const auto& [_, stmt] : stmt_cache) sqlite3_finalize(stmt);
+	stmt_cache.clear();
+}
+
 pack::~pack() {
+	if (lazy_load.valid()) lazy_load.wait();
+	replace_prefetcher(nullptr);
+	release_blob_pool();
+	finalize_stmt_cache();
+	finish_profile();
 	if (db && !created_from_copy) {
 		sqlite3_close(db);
 		db = nullptr;
@@ -221,11 +784,36 @@ bool pack::rekey(const string& key) {
 	return true;
 }
 
+void pack::finish_profile() {
+	if (!db || created_from_copy || sqlite3_db_readonly(db, "main") != 0 || profile != PackProfile::BulkBuild) return;
+	// Make the build durable before handing the file over, as it was written with synchronous off.
+	sqlite3_exec(db, "pragma synchronous=normal; pragma wal_checkpoint(truncate);", nullptr, nullptr, nullptr);
+}
+
+void pack::set_profile(const PackProfile new_profile) {
+	profile = new_profile;
+	if (!db) return;
+	const bool writable = sqlite3_db_readonly(db, "main") == 0;
+	// page_size is fixed once the pack exists; the rest applies to the open connection.
+	if (writable) sqlite3_exec(db, get_profile_settings(profile).exclusive ? "pragma locking_mode=exclusive;" : "pragma locking_mode=normal;", nullptr, nullptr, nullptr);
+	apply_profile_tuning(db, profile, writable);
+	start_read_pool();
+}
+
 bool pack::close() {
-	return sqlite3_close(db) == SQLITE_OK;
+	if (lazy_load.valid()) lazy_load.wait();
+	replace_prefetcher(nullptr);
+	replace_read_pool(nullptr);
+	release_blob_pool();
+	finalize_stmt_cache();
+	finish_profile();
+	if (sqlite3_close(db) != SQLITE_OK) return false;
+	db = nullptr;
+	return true;
 }
 
 bool pack::add_file(const string& disk_filename, const string& pack_filename, bool allow_replace) {
+	begin_write();
 	if (!filesystem::exists(disk_filename)) return false;
 	const auto file_size = filesystem::file_size(disk_filename);
 	if (file_size > SQLITE_MAX_LENGTH) return false;
@@ -233,211 +821,1243 @@ bool pack::add_file(const string& disk_filename, const string& pack_filename, bo
 		if (allow_replace) delete_file(pack_filename);
 		else return false;
 	}
-	ifstream stream(filesystem::canonical(disk_filename).string(), ios::in | ios::binary);
-	const int64_t rowid = insert_blob_from_stream(db, pack_filename, stream, file_size);
-	entry_cache.insert_or_assign(pack_filename, pack_entry{pack_filename, file_size, rowid});
+	return store_file(pack_filename, filesystem::canonical(disk_filename).string(), file_size, true);
+}
+
+bool pack::store_file(const string& name, const string& disk_path, const uint64_t size, const bool try_compress) {
+	// Mapping the file lets SQLite copy straight out of the page cache, and compression and deduplication work on the whole file at once.
+	unique_ptr<Poco::SharedMemory> mapped;
+	if (map_imports && size >= IMPORT_MAP_MIN) {
+		try {
+			mapped = make_unique<Poco::SharedMemory>(Poco::File(disk_path), Poco::SharedMemory::AM_READ);
+		} catch (Poco::Exception&) {
+			// Fall back to streaming, for instance on filesystems that can't be mapped.
+		}
+	}
+	if (mapped && static_cast<uint64_t>(mapped->end() - mapped->begin()) == size) {
+		if (try_compress || deduplicate) store_entry(name, mapped->begin(), size);
+		else insert_entry(name, mapped->begin(), size);
+		return true;
+	}
+	mapped.reset();
+	ifstream stream(disk_path, ios::in | ios::binary);
+	if (!stream) return false;
+	if (try_compress || deduplicate) store_entry(name, stream, size);
+	else insert_entry(name, stream, size);
 	return true;
 }
 
-bool pack::add_directory(const string& dir, bool allow_replace) {
-	if (!filesystem::exists(dir) || !filesystem::is_directory(dir)) return false;
-	if (const auto rc = sqlite3_exec(db, "begin immediate transaction;", nullptr, nullptr, nullptr); rc != SQLITE_OK)
-		throw runtime_error(Poco::format("Could not begin transaction: %s", string(sqlite3_errmsg(db))));
+void pack::set_import_buffer_size(const uint32_t size) {
+	if (size == 0) throw invalid_argument("The import buffer needs at least one byte");
+	import_buffer_size = size;
+}
+
+void pack::insert_entry(const string& name, const void* data, uint64_t size) {
+	stmt_guard stmt(cached_stmt(INSERT_FILE_SQL), true);
+	bind_text(db, stmt, 1, name);
+	const int64_t rowid = insert_blob_memory(db, stmt, data, size);
+	frame_index_cache.erase(rowid);
+	cache_put(pack_entry{name, size, rowid});
+}
+
+void pack::insert_entry(const string& name, istream& src, uint64_t size) {
+	stmt_guard stmt(cached_stmt(INSERT_FILE_SQL), true);
+	bind_text(db, stmt, 1, name);
+	const int64_t rowid = insert_blob_from_stream(db, stmt, "pack_files", src, size, import_buffer_size);
+	frame_index_cache.erase(rowid);
+	cache_put(pack_entry{name, size, rowid});
+}
+
+void pack::insert_entry(const string& name, uint64_t size, const compressed_entry& entry) {
+	stmt_guard stmt(cached_stmt(INSERT_COMPRESSED_SQL), true);
+	bind_text(db, stmt, 1, name);
+	const int64_t rowid = insert_blob_compressed(db, stmt, size, entry);
+	frame_index_cache.erase(rowid);
+	cache_put(pack_entry{name, size, rowid, entry.codec});
+}
+
+int64_t pack::insert_content(const uint64_t hash, const void* data, const uint64_t size) {
+	stmt_guard stmt(cached_stmt(INSERT_CONTENT_SQL), true);
+	sqlite3_bind_int64(stmt, 1, static_cast<sqlite3_int64>(hash));
+	const int64_t id = insert_blob_memory(db, stmt, data, size);
+	frame_index_cache.erase(-id);
+	return id;
+}
+
+int64_t pack::insert_content(const uint64_t hash, istream& src, const uint64_t size) {
+	stmt_guard stmt(cached_stmt(INSERT_CONTENT_SQL), true);
+	sqlite3_bind_int64(stmt, 1, static_cast<sqlite3_int64>(hash));
+	const int64_t id = insert_blob_from_stream(db, stmt, "pack_content", src, size, import_buffer_size);
+	frame_index_cache.erase(-id);
+	return id;
+}
+
+int64_t pack::insert_content(const uint64_t hash, const uint64_t size, const compressed_entry& entry) {
+	stmt_guard stmt(cached_stmt(INSERT_COMPRESSED_CONTENT_SQL), true);
+	sqlite3_bind_int64(stmt, 1, static_cast<sqlite3_int64>(hash));
+	const int64_t id = insert_blob_compressed(db, stmt, size, entry);
+	frame_index_cache.erase(-id);
+	return id;
+}
+
+void pack::link_entry(const string& name, const pack_entry& content) {
+	stmt_guard stmt(cached_stmt(INSERT_LINK_SQL), true);
+	bind_text(db, stmt, 1, name);
+	sqlite3_bind_int64(stmt, 2, content.content);
+	query_rows(db, stmt, [](sqlite3_stmt*) {});
+	// The refs trigger just updated the content row, which expires any pooled handle on it.
+	release_blob_pool();
+	cache_put(pack_entry{name, content.size, sqlite3_last_insert_rowid(db), content.codec, content.content});
+}
+
+pack_entry pack::find_content(const uint64_t hash, const uint64_t size, const function<bool(const pack_entry&)>& same) const {
+	vector<pack_entry> candidates;
+	{
+		stmt_guard stmt(cached_stmt("select id, codec from pack_content where hash = ? and coalesce(size, length(data)) = ?"), true);
+		sqlite3_bind_int64(stmt, 1, static_cast<sqlite3_int64>(hash));
+		sqlite3_bind_int64(stmt, 2, static_cast<sqlite3_int64>(size));
+		query_rows(db, stmt, [&](sqlite3_stmt* s) { candidates.push_back(pack_entry{{}, size, 0, static_cast<PackCodec>(sqlite3_column_int(s, 1)), sqlite3_column_int64(s, 0)}); });
+	}
+	for (const auto& candidate : candidates) {
+		if (same(candidate)) return candidate;
+	}
+	return pack_entry{{}, size, 0};
+}
+
+static constexpr uint64_t CONTENT_COMPARE_CHUNK = 64 * 1024;
+
+bool pack::content_equals(const pack_entry& content, const void* data) const {
+	string chunk;
+	const auto bytes = static_cast<const char*>(data);
+	for (uint64_t offset = 0; offset < content.size; offset += chunk.size()) {
+		chunk.resize(min(CONTENT_COMPARE_CHUNK, content.size - offset));
+		read_entry_direct(content, offset, chunk.data(), chunk.size());
+		if (memcmp(chunk.data(), bytes + offset, chunk.size()) != 0) return false;
+	}
+	return true;
+}
+
+bool pack::content_equals(const pack_entry& content, istream& src) const {
+	string stored, incoming;
+	for (uint64_t offset = 0; offset < content.size; offset += stored.size()) {
+		stored.resize(min(CONTENT_COMPARE_CHUNK, content.size - offset));
+		incoming.resize(stored.size());
+		if (!src.read(incoming.data(), incoming.size())) return false;
+		read_entry_direct(content, offset, stored.data(), stored.size());
+		if (stored != incoming) return false;
+	}
+	return true;
+}
+
+// Compares the stored form. Entries are only recognised as duplicates of content compressed the same way, which is always the case within one build.
+bool pack::content_equals(const pack_entry& content, const compressed_entry& compressed) const {
+	if (content.codec != compressed.codec || get_frame_index(content)->serialize() != compressed.frames.serialize()) return false;
+	sqlite3_blob* blob = acquire_blob(content);
+	if (static_cast<uint64_t>(sqlite3_blob_bytes(blob)) != compressed.data.size()) return false;
+	string chunk;
+	for (uint64_t offset = 0; offset < compressed.data.size(); offset += chunk.size()) {
+		chunk.resize(min<uint64_t>(CONTENT_COMPARE_CHUNK, compressed.data.size() - offset));
+		if (const auto rc = sqlite3_blob_read(blob, chunk.data(), static_cast<int>(chunk.size()), static_cast<int>(offset)); rc != SQLITE_OK) {
+			release_blob_pool();
+			throw runtime_error(Poco::format("Internal error: %s", string(sqlite3_errmsg(db))));
+		}
+		if (memcmp(chunk.data(), compressed.data.data() + offset, chunk.size()) != 0) return false;
+	}
+	return true;
+}
+
+void pack::insert_deduplicated(const string& name, const uint64_t hash, const uint64_t size, const void* data, const compressed_entry* compressed) {
+	pack_entry content = find_content(hash, size, [&](const pack_entry& candidate) { return data ? content_equals(candidate, data) : content_equals(candidate, *compressed); });
+	if (!content.content) {
+		compressed_entry packed;
+		if (compressed) content = pack_entry{{}, size, 0, compressed->codec, insert_content(hash, size, *compressed)};
+		else if (compress_entry(compression, compression_level, compression_frame_size, data, size, packed)) content = pack_entry{{}, size, 0, packed.codec, insert_content(hash, size, packed)};
+		else content = pack_entry{{}, size, 0, PackCodec::None, insert_content(hash, data, size)};
+	}
+	link_entry(name, content);
+}
+
+void pack::store_entry(const string& name, const void* data, uint64_t size) {
+	if (deduplicate) return insert_deduplicated(name, content_hash(data, size), size, data, nullptr);
+	compressed_entry compressed;
+	if (compress_entry(compression, compression_level, compression_frame_size, data, size, compressed)) insert_entry(name, size, compressed);
+	else insert_entry(name, data, size);
+}
+
+void pack::store_entry(const string& name, istream& src, uint64_t size) {
+	compressed_entry compressed;
+	// Streams are hashed and compared in passes, so they can only be deduplicated when they can seek back.
+	if (const auto start = src.tellg(); deduplicate && start != streampos(-1)) {
+		content_hasher hasher;
+		string chunk;
+		for (uint64_t done = 0; done < size; done += chunk.size()) {
+			chunk.resize(min(CONTENT_COMPARE_CHUNK, size - done));
+			if (!src.read(chunk.data(), chunk.size())) throw runtime_error(Poco::format("Could not read %s", name));
+			hasher.update(chunk.data(), chunk.size());
+		}
+		const uint64_t hash = hasher.digest();
+		const auto rewind = [&] {
+			src.clear();
+			src.seekg(start);
+		};
+		rewind();
+		pack_entry content = find_content(hash, size, [&](const pack_entry& candidate) {
+			const bool same = content_equals(candidate, src);
+			rewind();
+			return same;
+		});
+		if (!content.content) {
+			if (compression != PackCodec::None && compress_entry(compression, compression_level, compression_frame_size, src, size, compressed)) content = pack_entry{{}, size, 0, compressed.codec, insert_content(hash, size, compressed)};
+			else {
+				rewind();
+				content = pack_entry{{}, size, 0, PackCodec::None, insert_content(hash, src, size)};
+			}
+		}
+		link_entry(name, content);
+		return;
+	}
+	if (compression != PackCodec::None) {
+		const auto start = src.tellg();
+		if (compress_entry(compression, compression_level, compression_frame_size, src, size, compressed)) {
+			insert_entry(name, size, compressed);
+			return;
+		}
+		src.clear();
+		src.seekg(start);
+	}
+	insert_entry(name, src, size);
+}
+
+// Files above this size are not buffered by the add_directory readers; unless they compress, the writer streams them from disk itself so that the queue stays bounded.
+static constexpr uint64_t DIRECTORY_BUFFER_LIMIT = 32 * 1024 * 1024;
+// Upper bound on the bytes the add_directory readers may have queued ahead of the writer.
+static constexpr uint64_t DIRECTORY_QUEUE_BYTES = 128 * 1024 * 1024;
+
+struct directory_item {
+	string disk_path;
+	string pack_name;
+	string data;
+	compressed_entry compressed;
+	uint64_t size = 0;
+	int64_t mtime = 0;
+	uint64_t hash = 0; // Of the uncompressed bytes, when deduplicating a buffered item or syncing.
+	bool buffered = false;
+	bool is_compressed = false;
+	bool replaces = false; // Set by sync_directory when the entry already exists.
+	bool ok = true;
+	size_t queued_bytes() const { return data.size() + compressed.data.size(); }
+};
+
+namespace {
+
+// Bounded hand-off between the add_directory reader threads and the writer. Items larger than the budget are admitted only into an empty queue so that a single huge file can't deadlock the pipeline.
+class directory_queue {
+	mutex m;
+	condition_variable not_full, not_empty;
+	deque<directory_item> items;
+	uint64_t queued_bytes = 0, reserved_bytes = 0;
+	size_t producers;
+	bool stopped = false;
+	bool fits(uint64_t bytes) const { return (items.empty() && reserved_bytes == 0) || queued_bytes + reserved_bytes + bytes <= DIRECTORY_QUEUE_BYTES; }
+public:
+	directory_queue(size_t producer_count) : producers(producer_count) {}
+	// Claims budget for an item that is built up in memory before it is pushed, such as a large file being compressed. Returns false if the queue stopped while waiting.
+	bool reserve(uint64_t bytes) {
+		unique_lock lock(m);
+		not_full.wait(lock, [&] { return stopped || fits(bytes); });
+		if (stopped) return false;
+		reserved_bytes += bytes;
+		return true;
+	}
+	// reserved is the budget claimed for this item, which must cover it; such items are queued without waiting again.
+	void push(directory_item&& item, uint64_t reserved = 0) {
+		unique_lock lock(m);
+		const auto bytes = item.queued_bytes();
+		reserved_bytes -= reserved;
+		if (!reserved) not_full.wait(lock, [&] { return stopped || fits(bytes); });
+		else not_full.notify_all();
+		if (stopped) return;
+		queued_bytes += bytes;
+		items.push_back(std::move(item));
+		not_empty.notify_one();
+	}
+	bool pop(directory_item& item) {
+		unique_lock lock(m);
+		not_empty.wait(lock, [&] { return stopped || !items.empty() || producers == 0; });
+		if (items.empty()) return false;
+		item = std::move(items.front());
+		items.pop_front();
+		queued_bytes -= item.queued_bytes();
+		not_full.notify_all();
+		return true;
+	}
+	void producer_done() {
+		lock_guard lock(m);
+		producers--;
+		not_empty.notify_all();
+	}
+	void stop() {
+		lock_guard lock(m);
+		stopped = true;
+		not_full.notify_all();
+		not_empty.notify_all();
+	}
+	bool is_stopped() {
+		lock_guard lock(m);
+		return stopped;
+	}
+};
+}
+
+static vector<directory_item> scan_directory(const string& dir) {
+	vector<directory_item> files;
 	for (const auto& f : filesystem::recursive_directory_iterator(dir)) {
 		if (!f.is_regular_file()) continue;
-		auto p = f.path().string();
-		ranges::replace(p, '\\', '/');
-		if (!add_file(f.path().string(), p, allow_replace)) {
-			if (!sqlite3_get_autocommit(db)) sqlite3_exec(db, "rollback;", nullptr, nullptr, nullptr);
-			return false;
+		directory_item item;
+		item.disk_path = f.path().string();
+		item.pack_name = item.disk_path;
+		ranges::replace(item.pack_name, '\\', '/');
+		error_code ec;
+		item.size = f.file_size(ec);
+		item.mtime = static_cast<int64_t>(f.last_write_time(ec).time_since_epoch().count());
+		files.push_back(std::move(item));
+	}
+	return files;
+}
+
+static uint64_t hash_file(const string& path) {
+	ifstream stream(path, ios::in | ios::binary);
+	if (!stream) throw runtime_error(Poco::format("Could not open %s", path));
+	content_hasher hasher;
+	vector<char> buffer(CONTENT_COMPARE_CHUNK);
+	while (stream) {
+		stream.read(buffer.data(), buffer.size());
+		hasher.update(buffer.data(), static_cast<size_t>(stream.gcount()));
+	}
+	if (stream.bad()) throw runtime_error(Poco::format("Could not read %s", path));
+	return hasher.digest();
+}
+
+static unsigned int pipeline_threads(unsigned int thread_count, const size_t work) {
+	if (thread_count == 0) thread_count = max(1u, thread::hardware_concurrency());
+	return static_cast<unsigned int>(min<size_t>(thread_count, max<size_t>(work, 1)));
+}
+
+bool pack::write_directory_items(vector<directory_item>& files, const bool allow_replace, unsigned int thread_count, const bool hash_all, const progress_callback& progress, const function<void(const directory_item&)>& written) {
+	thread_count = pipeline_threads(thread_count, files.size());
+	directory_queue queue(thread_count);
+	atomic<size_t> next_file(0);
+	vector<thread> readers;
+	readers.reserve(thread_count);
+	for (unsigned int i = 0; i < thread_count; i++) readers.emplace_back([&] {
+		for (size_t idx = next_file++; idx < files.size() && !queue.is_stopped(); idx = next_file++) {
+			directory_item item = std::move(files[idx]);
+			error_code ec;
+			item.size = filesystem::file_size(item.disk_path, ec);
+			if (ec || item.size > SQLITE_MAX_LENGTH) item.ok = false;
+			else if (item.size <= DIRECTORY_BUFFER_LIMIT) {
+				// An exception escaping a reader would terminate the process, so a file that can't be buffered or compressed just fails the import.
+				try {
+					ifstream stream(item.disk_path, ios::in | ios::binary);
+					item.data.resize(item.size);
+					item.ok = stream && stream.read(item.data.data(), item.size) && static_cast<uint64_t>(stream.gcount()) == item.size;
+					item.buffered = true;
+					if (item.ok && (deduplicate || hash_all)) item.hash = content_hash(item.data.data(), item.size);
+					if (item.ok && compress_entry(compression, compression_level, compression_frame_size, item.data.data(), item.size, item.compressed)) {
+						item.is_compressed = true;
+						string().swap(item.data);
+					} else item.compressed = compressed_entry();
+				} catch (exception&) {
+					item.ok = false;
+					item.is_compressed = false;
+					string().swap(item.data);
+					item.compressed = compressed_entry();
+				}
+			} else {
+				uint64_t reserved = 0;
+				try {
+					if (hash_all) item.hash = hash_file(item.disk_path);
+					// The compressed bytes collect in memory, never exceeding the file's size, until the writer takes them, so they count against the queue's budget from the start.
+					if (compression != PackCodec::None && !deduplicate) {
+						if (!queue.reserve(item.size)) break;
+						reserved = item.size;
+						ifstream stream(item.disk_path, ios::in | ios::binary);
+						item.is_compressed = stream && compress_entry(compression, compression_level, compression_frame_size, stream, item.size, item.compressed);
+					}
+				} catch (exception&) {
+					item.ok = false;
+				}
+				if (!item.is_compressed) item.compressed = compressed_entry();
+				queue.push(std::move(item), reserved);
+				continue;
+			}
+			queue.push(std::move(item));
 		}
+		queue.producer_done();
+	});
+	const auto finish_readers = [&] {
+		queue.stop();
+		for (auto& t : readers) t.join();
+		readers.clear();
+	};
+	try {
+		directory_item item;
+		uint64_t done = 0;
+		while (queue.pop(item)) {
+			if (!item.ok || (file_exists(item.pack_name) && !allow_replace)) {
+				finish_readers();
+				return false;
+			}
+			if (file_exists(item.pack_name)) delete_file(item.pack_name);
+			if (deduplicate && item.buffered) insert_deduplicated(item.pack_name, item.hash, item.size, item.is_compressed ? nullptr : item.data.data(), item.is_compressed ? &item.compressed : nullptr);
+			else if (item.is_compressed) insert_entry(item.pack_name, item.size, item.compressed);
+			else if (item.buffered) insert_entry(item.pack_name, item.data.data(), item.data.size());
+			else {
+				// Large files are hashed and compressed by the writer when deduplicating, as that needs the pack's content table. Otherwise the readers already found they don't compress.
+				if (!store_file(item.pack_name, filesystem::canonical(item.disk_path).string(), item.size, false)) {
+					finish_readers();
+					return false;
+				}
+			}
+			if (written) written(item);
+			if (progress) progress(item.pack_name, ++done, files.size());
+		}
+	} catch (...) {
+		finish_readers();
+		throw;
+	}
+	finish_readers();
+	return true;
+}
+
+bool pack::add_directory(const string& dir, bool allow_replace, unsigned int thread_count, const progress_callback& progress) {
+	begin_write();
+	if (!filesystem::exists(dir) || !filesystem::is_directory(dir)) return false;
+	vector<directory_item> files = scan_directory(dir);
+	if (const auto rc = sqlite3_exec(db, "begin immediate transaction;", nullptr, nullptr, nullptr); rc != SQLITE_OK)
+		throw runtime_error(Poco::format("Could not begin transaction: %s", string(sqlite3_errmsg(db))));
+	bool ok;
+	try {
+		ok = write_directory_items(files, allow_replace, thread_count, false, progress, nullptr);
+	} catch (...) {
+		if (!sqlite3_get_autocommit(db)) sqlite3_exec(db, "rollback;", nullptr, nullptr, nullptr);
+		load_entry_cache();
+		throw;
+	}
+	if (!ok) {
+		if (!sqlite3_get_autocommit(db)) sqlite3_exec(db, "rollback;", nullptr, nullptr, nullptr);
+		load_entry_cache();
+		return false;
 	}
 	if (const auto rc = sqlite3_exec(db, "commit;", nullptr, nullptr, nullptr); rc != SQLITE_OK)
 		throw runtime_error(Poco::format("Could not commit transaction: %s", string(sqlite3_errmsg(db))));
 	return true;
 }
 
-bool pack::add_stream(const string& internal_name, void* ds, const bool allow_replace) {
-	if (!ds) return false;
-	if (file_exists(internal_name)) {
-		if (allow_replace) delete_file(internal_name);
-		else return false;
+pack::sync_summary pack::sync_directory(const string& dir, unsigned int thread_count, const progress_callback& progress) {
+	begin_write();
+	if (!filesystem::exists(dir) || !filesystem::is_directory(dir)) throw runtime_error(Poco::format("%s is not a directory", dir));
+	vector<directory_item> files = scan_directory(dir);
+	struct manifest_row {
+		int64_t mtime;
+		uint64_t size;
+		uint64_t hash;
+	};
+	unordered_map<string, manifest_row> manifest;
+	{
+		stmt_guard stmt(prepare_stmt(db, "select file_name, mtime, size, hash from pack_manifest"));
+		query_rows(db, stmt, [&](sqlite3_stmt* s) { manifest.emplace(column_string(s, 0), manifest_row{sqlite3_column_int64(s, 1), static_cast<uint64_t>(sqlite3_column_int64(s, 2)), static_cast<uint64_t>(sqlite3_column_int64(s, 3))}); });
+	}
+	unordered_set<string> present;
+	present.reserve(files.size());
+	for (const auto& item : files) present.insert(item.pack_name);
+	sync_summary summary;
+	vector<directory_item> changed;
+	// Files whose size matches the manifest but whose mtime doesn't, as after a fresh checkout, are hashed before being called changed.
+	vector<directory_item> suspects;
+	for (auto& item : files) {
+		const auto it = manifest.find(item.pack_name);
+		item.replaces = file_exists(item.pack_name);
+		if (it == manifest.end() || !item.replaces || it->second.size != item.size) changed.push_back(std::move(item));
+		else if (it->second.mtime == item.mtime) summary.skipped++;
+		else suspects.push_back(std::move(item));
+	}
+	{
+		atomic<size_t> next(0);
+		vector<thread> hashers;
+		const unsigned int count = pipeline_threads(thread_count, suspects.size());
+		for (unsigned int i = 0; i < count && !suspects.empty(); i++) hashers.emplace_back([&] {
+			for (size_t idx = next++; idx < suspects.size(); idx = next++) {
+				try {
+					suspects[idx].hash = hash_file(suspects[idx].disk_path);
+				} catch (exception&) {
+					suspects[idx].ok = false;
+				}
+			}
+		});
+		for (auto& t : hashers) t.join();
+	}
+	vector<const directory_item*> touched;
+	for (auto& item : suspects) {
+		if (item.ok && manifest.at(item.pack_name).hash == item.hash) {
+			summary.skipped++;
+			touched.push_back(&item);
+		} else {
+			item.ok = true;
+			changed.push_back(std::move(item));
+		}
+	}
+	vector<string> vanished;
+	for (const auto& [name, row] : manifest) {
+		if (!present.count(name)) vanished.push_back(name);
+	}
+	if (const auto rc = sqlite3_exec(db, "begin immediate transaction;", nullptr, nullptr, nullptr); rc != SQLITE_OK)
+		throw runtime_error(Poco::format("Could not begin transaction: %s", string(sqlite3_errmsg(db))));
+	try {
+		for (const auto& name : vanished) {
+			if (file_exists(name)) delete_file(name);
+			stmt_guard stmt(cached_stmt("delete from pack_manifest where file_name = ?"), true);
+			bind_text(db, stmt, 1, name);
+			query_rows(db, stmt, [](sqlite3_stmt*) {});
+			summary.removed++;
+		}
+		for (const auto* item : touched) {
+			stmt_guard stmt(cached_stmt("update pack_manifest set mtime = ? where file_name = ?"), true);
+			sqlite3_bind_int64(stmt, 1, item->mtime);
+			bind_text(db, stmt, 2, item->pack_name);
+			query_rows(db, stmt, [](sqlite3_stmt*) {});
+		}
+		const bool ok = write_directory_items(changed, true, thread_count, true, progress, [&](const directory_item& item) {
+			stmt_guard stmt(cached_stmt("insert or replace into pack_manifest(file_name, mtime, size, hash) values(?, ?, ?, ?)"), true);
+			bind_text(db, stmt, 1, item.pack_name);
+			sqlite3_bind_int64(stmt, 2, item.mtime);
+			sqlite3_bind_int64(stmt, 3, static_cast<sqlite3_int64>(item.size));
+			sqlite3_bind_int64(stmt, 4, static_cast<sqlite3_int64>(item.hash));
+			query_rows(db, stmt, [](sqlite3_stmt*) {});
+			if (item.replaces) summary.updated++;
+			else summary.added++;
+		});
+		if (!ok) throw runtime_error(Poco::format("Could not read every file in %s", dir));
+		if (const auto rc = sqlite3_exec(db, "commit;", nullptr, nullptr, nullptr); rc != SQLITE_OK)
+			throw runtime_error(Poco::format("Could not commit transaction: %s", string(sqlite3_errmsg(db))));
+	} catch (...) {
+		if (!sqlite3_get_autocommit(db)) sqlite3_exec(db, "rollback;", nullptr, nullptr, nullptr);
+		load_entry_cache();
+		throw;
+	}
+	return summary;
+}
+
+CScriptDictionary* pack::sync_directory_script(const string& dir, unsigned int thread_count, asIScriptFunction* progress) {
+	const auto cb = script_progress_callback(progress);
+	sync_summary summary;
+	try {
+		summary = sync_directory(dir, thread_count, cb);
+		if (progress) progress->Release();
+	} catch (...) {
+		if (progress) progress->Release();
+		throw;
+	}
+	CScriptDictionary* d = CScriptDictionary::Create(asGetActiveContext()->GetEngine());
+	d->Set("added", static_cast<asINT64>(summary.added));
+	d->Set("updated", static_cast<asINT64>(summary.updated));
+	d->Set("removed", static_cast<asINT64>(summary.removed));
+	d->Set("skipped", static_cast<asINT64>(summary.skipped));
+	return d;
+}
+
+bool pack::add_directory_script(const string& dir, bool allow_replace, unsigned int thread_count, asIScriptFunction* progress) {
+	const auto cb = script_progress_callback(progress);
+	try {
+		const bool ret = add_directory(dir, allow_replace, thread_count, cb);
+		if (progress) progress->Release();
+		return ret;
+	} catch (...) {
+		if (progress) progress->Release();
+		throw;
+	}
+}
+
+bool pack::add_stream(const string& internal_name, void* ds, const bool allow_replace) {
+	begin_write();
+	if (!ds) return false;
+	if (file_exists(internal_name)) {
+		if (allow_replace) delete_file(internal_name);
+		else return false;
+	}
+	istream* is = dynamic_cast<istream*>(nvgt_datastream_get_ios(ds));
+	if (!is) return false;
+	is->seekg(0, ios::end);
+	const uint64_t stream_size = is->tellg();
+	is->seekg(0, ios::beg);
+	store_entry(internal_name, *is, stream_size);
+	return true;
+}
+
+bool pack::add_memory(const string& pack_filename, unsigned char* data, unsigned int size, bool allow_replace) {
+	begin_write();
+	if (size > SQLITE_MAX_LENGTH) return false;
+	if (file_exists(pack_filename)) {
+		if (!allow_replace) return false;
+		delete_file(pack_filename);
+	}
+	store_entry(pack_filename, data, size);
+	return true;
+}
+
+bool pack::add_memory(const string& pack_filename, const string& data, bool allow_replace) {
+	begin_write();
+	if (data.empty() || data.size() > SQLITE_MAX_LENGTH) return false;
+	if (file_exists(pack_filename)) {
+		if (!allow_replace) return false;
+		delete_file(pack_filename);
+	}
+	store_entry(pack_filename, data.data(), data.size());
+	return true;
+}
+
+bool pack::delete_file(const string& pack_filename) {
+	begin_write();
+	if (!file_exists(pack_filename)) return false;
+	stmt_guard stmt(cached_stmt("delete from pack_files where file_name = ?"), true);
+	bind_text(db, stmt, 1, pack_filename);
+	query_rows(db, stmt, [](sqlite3_stmt*) {});
+	cache_erase(pack_filename);
+	return true;
+}
+
+bool pack::file_exists(const string& pack_filename) {
+	return find_entry(pack_filename) != nullptr;
+}
+
+string pack::get_file_name(const int64_t idx) {
+	ensure_entry_cache();
+	const auto entry = entry_cache.find_rowid(idx);
+	return entry ? string(entry->name) : "";
+}
+
+void pack::list_files(vector<string>& files) {
+	ensure_entry_cache();
+	const auto& names = entry_cache.sorted_names();
+	files.reserve(files.size() + names.size());
+	for (const auto name : names) files.emplace_back(name);
+}
+
+void pack::list_directory(const string& dir, vector<string>& files, const bool recursive) const {
+	string prefix = dir;
+	ranges::replace(prefix, '\\', '/');
+	if (!prefix.empty() && prefix.back() != '/') prefix.push_back('/');
+	ensure_entry_cache();
+	const auto [first, last] = prefix_range(entry_cache.sorted_names(), prefix);
+	for (auto it = first; it != last; ++it) {
+		if (recursive) { files.emplace_back(*it); continue; }
+		// Anything deeper than one level collapses into its subdirectory, which sorts contiguously so only the last one listed needs checking.
+		const auto rest = it->substr(prefix.size());
+		const auto slash = rest.find('/');
+		if (slash == string_view::npos) files.emplace_back(*it);
+		else {
+			string subdir(it->substr(0, prefix.size() + slash + 1));
+			if (files.empty() || files.back() != subdir) files.push_back(std::move(subdir));
+		}
+	}
+}
+
+CScriptArray* pack::list_directory(const string& dir, const bool recursive) const {
+	vector<string> files;
+	list_directory(dir, files, recursive);
+	asIScriptContext* ctx = asGetActiveContext();
+	asIScriptEngine* engine = ctx->GetEngine();
+	CScriptArray* array = CScriptArray::Create(engine->GetTypeInfoByDecl("array<string>"), static_cast<asUINT>(files.size()));
+	for (asUINT i = 0; i < files.size(); i++) static_cast<string*>(array->At(i))->swap(files[i]);
+	return array;
+}
+
+int64_t pack::get_file_count() {
+	ensure_entry_cache();
+	return static_cast<int64_t>(entry_cache.size());
+}
+
+CScriptArray* pack::list_files() {
+	asIScriptContext* ctx = asGetActiveContext();
+	asIScriptEngine* engine = ctx->GetEngine();
+	CScriptArray* array = CScriptArray::Create(engine->GetTypeInfoByDecl("array<string>"));
+	ensure_entry_cache();
+	const auto& names = entry_cache.sorted_names();
+	array->Resize(static_cast<asUINT>(names.size()));
+	for (asUINT i = 0; i < names.size(); i++) static_cast<string*>(array->At(i))->assign(names[i]);
+	return array;
+}
+
+uint64_t pack::get_file_size(const string& pack_filename) {
+	const auto entry = find_entry(pack_filename);
+	return entry ? entry->size : 0;
+}
+
+int64_t pack::get_rowid(const string& filename) const {
+	const auto entry = find_entry(filename);
+	return entry ? entry->rowid : 0;
+}
+
+static constexpr const char* FIND_ENTRY_SQL = "select id, file_name, size, codec, content from pack_entries where file_name = ?";
+
+// optimize renumbers every rowid of the pack a copy was made from, leaving the copy's entries pointing at other files' bytes. Only the script's thread reloads, and the caller holds entry_mutex.
+void pack::sync_rowid_epoch() const {
+	const uint64_t epoch = *rowid_epoch;
+	if (epoch == loaded_rowid_epoch) return;
+	loaded_rowid_epoch = epoch;
+	pending_entries.clear();
+	if (!entry_cache_ready()) return;
+	entry_cache.clear();
+	load_entries(db, entry_cache);
+}
+
+const pack_entry* pack::find_entry(const string& filename) const {
+	lock_guard lock(entry_mutex);
+	if (*rowid_epoch != loaded_rowid_epoch) {
+		sync_rowid_epoch();
+		frame_index_cache.clear();
+	}
+	if (entry_cache_ready()) return entry_cache.find(filename);
+	if (const auto it = pending_entries.find(filename); it != pending_entries.end()) return &it->second;
+	stmt_guard stmt(cached_stmt(FIND_ENTRY_SQL), true);
+	bind_text(db, stmt, 1, filename);
+	const pack_entry* found = nullptr;
+	query_rows(db, stmt, [&](sqlite3_stmt* s) {
+		const auto it = pending_entries.insert_or_assign(filename, column_entry(s, {})).first;
+		it->second.name = it->first;
+		found = &it->second;
+	});
+	return found;
+}
+
+optional<pack_entry> pack::lookup_entry(const string& filename) const {
+	lock_guard lock(entry_mutex);
+	// Entries from before an optimize the script's thread hasn't caught up with yet are bypassed rather than reloaded here.
+	const bool current = *rowid_epoch == loaded_rowid_epoch;
+	optional<pack_entry> found;
+	if (current && entry_cache_ready()) {
+		if (const auto entry = entry_cache.find(filename)) found = *entry;
+	} else if (const auto it = pending_entries.find(filename); current && it != pending_entries.end()) found = it->second;
+	else {
+		stmt_guard stmt(prepare_stmt(db, FIND_ENTRY_SQL));
+		bind_text(db, stmt, 1, filename);
+		query_rows(db, stmt, [&](sqlite3_stmt* s) { found = column_entry(s, {}); });
+	}
+	// The caller's string outlives the copy, whatever writes on other threads do to the tables the name came from.
+	if (found) found->name = filename;
+	return found;
+}
+
+PackCodec pack::get_file_codec(const string& pack_filename) const {
+	const auto entry = find_entry(pack_filename);
+	return entry ? entry->codec : PackCodec::None;
+}
+
+shared_ptr<const frame_index> pack::get_frame_index(const pack_entry& entry) const {
+	if (const auto it = frame_index_cache.find(entry.data_key()); it != frame_index_cache.end()) return it->second;
+	stmt_guard stmt(cached_stmt(entry.content ? "select frames from pack_content where id = ?" : "select frames from pack_files where rowid = ?"), true);
+	sqlite3_bind_int64(stmt, 1, entry.data_rowid());
+	shared_ptr<const frame_index> idx;
+	query_rows(db, stmt, [&](sqlite3_stmt* s) {
+		idx = make_shared<const frame_index>(frame_index::parse(sqlite3_column_blob(s, 0), sqlite3_column_bytes(s, 0)));
+	});
+	if (!idx) throw runtime_error(Poco::format("Missing frame index for %s", string(entry.name)));
+	frame_index_cache.emplace(entry.data_key(), idx);
+	return idx;
+}
+
+void pack::read_entry(const pack_entry& entry, uint64_t offset, void* buffer, uint64_t size) const {
+	if (const auto payload = find_decoded(entry); payload && offset + size <= payload->size()) {
+		memcpy(buffer, payload->data() + offset, size);
+		return;
+	}
+	read_entry_direct(entry, offset, buffer, size);
+}
+
+void pack::read_entry_direct(const pack_entry& entry, uint64_t offset, void* buffer, uint64_t size) const {
+	for (int attempt = 0;; attempt++) {
+		sqlite3_blob* blob = acquire_blob(entry);
+		try {
+			read_entry(blob, entry, offset, buffer, size);
+			return;
+		} catch (...) {
+			// The handle may have been aborted; don't hand it out again. Writes through statements from prepare expire handles without the pool knowing, so an aborted read is tried once more on a fresh one.
+			release_blob_pool();
+			if (attempt > 0 || (sqlite3_extended_errcode(db) & 0xff) != SQLITE_ABORT) throw;
+		}
+	}
+}
+
+sqlite3_blob* pack::acquire_blob(const pack_entry& entry) const {
+	// A commit leaves pooled handles expired or reading an old snapshot, so start over whenever the data version moves.
+	if (const auto version = data_version(db); version != blob_pool_version) {
+		release_blob_pool();
+		blob_pool_version = version;
+	}
+	const int64_t key = entry.data_key();
+	pooled_blob* lru = nullptr;
+	pooled_blob* lru_same_table = nullptr;
+	for (auto& pooled : blob_pool) {
+		if (pooled.key == key) {
+			pooled.last_use = ++blob_clock;
+			blob_reuses++;
+			return pooled.blob;
+		}
+		if (!lru || pooled.last_use < lru->last_use) lru = &pooled;
+		if ((pooled.key < 0) == (key < 0) && (!lru_same_table || pooled.last_use < lru_same_table->last_use)) lru_same_table = &pooled;
+	}
+	if (blob_pool.size() >= BLOB_POOL_SIZE) {
+		if (lru_same_table) {
+			if (sqlite3_blob_reopen(lru_same_table->blob, entry.data_rowid()) == SQLITE_OK) {
+				lru_same_table->key = key;
+				lru_same_table->last_use = ++blob_clock;
+				blob_reopens++;
+				return lru_same_table->blob;
+			}
+			// A failed reopen leaves the handle aborted, so replace it with a fresh one.
+			lru = lru_same_table;
+		}
+		sqlite3_blob_close(lru->blob);
+		blob_pool.erase(blob_pool.begin() + (lru - blob_pool.data()));
+	}
+	sqlite3_blob* blob;
+	if (const auto rc = sqlite3_blob_open(db, "main", entry.data_table(), "data", entry.data_rowid(), 0, &blob); rc != SQLITE_OK) {
+		sqlite3_blob_close(blob);
+		throw runtime_error(Poco::format("Internal error: %s", string(sqlite3_errmsg(db))));
+	}
+	blob_opens++;
+	blob_pool.push_back(pooled_blob{blob, key, ++blob_clock});
+	return blob;
+}
+
+void pack::release_blob_pool() const {
+	for (const auto& pooled : blob_pool) sqlite3_blob_close(pooled.blob);
+	blob_pool.clear();
+}
+
+void pack::begin_write() {
+	ensure_entry_cache();
+	{
+		lock_guard lock(entry_mutex);
+		pending_entries.clear();
 	}
-	istream* is = dynamic_cast<istream*>(nvgt_datastream_get_ios(ds));
-	if (!is) return false;
-	is->seekg(0, ios::end);
-	const uint64_t stream_size = is->tellg();
-	is->seekg(0, ios::beg);
-	const int64_t rowid = insert_blob_from_stream(db, internal_name, *is, stream_size);
-	entry_cache.insert_or_assign(internal_name, pack_entry{internal_name, stream_size, rowid});
-	return true;
+	release_blob_pool();
+	if (prefetcher) prefetcher->clear();
+	file_cache->clear();
 }
 
-bool pack::add_memory(const string& pack_filename, unsigned char* data, unsigned int size, bool allow_replace) {
-	if (size > SQLITE_MAX_LENGTH) return false;
-	if (file_exists(pack_filename)) {
-		if (!allow_replace) return false;
-		delete_file(pack_filename);
+shared_ptr<const string> pack::find_decoded(const pack_entry& entry, sqlite3* connection) const {
+	// Inside a transaction the connection may see changes that aren't committed, which must stay out of the cache copies share.
+	if (!sqlite3_get_autocommit(db)) return nullptr;
+	// Payloads are stored against the data version of the writing pack, which moves with each of its commits, so a copy reading an older snapshot can neither serve nor store bytes a later commit replaced, even when a rowid is reused.
+	sqlite3* writer = cache_version_connection();
+	const auto version = data_version(writer);
+	if (const auto prefetched = current_prefetcher()) {
+		if (auto payload = prefetched->find(entry.data_key(), version)) return payload;
 	}
-	const int64_t rowid = insert_blob_memory(db, pack_filename, data, size);
-	entry_cache.insert_or_assign(pack_filename, pack_entry{pack_filename, size, rowid});
-	return true;
+	if (!file_cache->accepts(entry.size)) return nullptr;
+	if (auto payload = file_cache->get(entry.data_key(), version)) return payload;
+	const auto generation = file_cache->get_generation();
+	auto payload = make_shared<string>(entry.size, '\0');
+	if (connection) entry_reader(connection).read(entry, payload->data());
+	else read_entry_direct(entry, 0, payload->data(), entry.size);
+	// A commit landing mid-read leaves it unclear which snapshot the bytes came from.
+	if (data_version(writer) == version) file_cache->put(entry.data_key(), payload, generation, version);
+	return payload;
 }
 
-bool pack::add_memory(const string& pack_filename, const string& data, bool allow_replace) {
-	if (data.empty() || data.size() > SQLITE_MAX_LENGTH) return false;
-	if (file_exists(pack_filename)) {
-		if (!allow_replace) return false;
-		delete_file(pack_filename);
-	}
-	const int64_t rowid = insert_blob_memory(db, pack_filename, data.data(), data.size());
-	entry_cache.insert_or_assign(pack_filename, pack_entry{pack_filename, data.size(), rowid});
-	return true;
+sqlite3* pack::cache_version_connection() const {
+	const pack* origin = this;
+	while (origin->mutable_origin && origin->mutable_origin->db) origin = origin->mutable_origin;
+	return origin->db;
 }
 
-bool pack::delete_file(const string& pack_filename) {
-	if (!file_exists(pack_filename)) return false;
-	auto stmt = prepare_stmt(db, "delete from pack_files where file_name = ?");
-	bind_text(db, stmt, 1, pack_filename);
-	query_rows(db, stmt, [](sqlite3_stmt*) {});
-	entry_cache.erase(pack_filename);
-	return true;
+void pack::prefetch(const vector<string>& names, const int priority) {
+	vector<pack_prefetcher::job> jobs;
+	const auto version = data_version(cache_version_connection());
+	for (const auto& name : names) {
+		const auto entry = find_entry(name);
+		if (entry) jobs.push_back(pack_prefetcher::job{name, entry->rowid, entry->size, entry->codec, entry->content, priority, 0, version});
+	}
+	if (jobs.empty()) return;
+	if (!prefetcher) {
+		const auto filename = sqlite3_filename_database(sqlite3_db_filename(db, "main"));
+		if (!filename || !*filename) throw runtime_error("Cannot prefetch from an in-memory or temporary pack");
+		replace_prefetcher(make_shared<pack_prefetcher>(filename, pack_key, prefetch_threads, prefetch_cache_limit));
+	}
+	prefetcher->enqueue(std::move(jobs));
 }
 
-bool pack::file_exists(const string& pack_filename) {
-	return entry_cache.count(pack_filename) > 0;
+shared_ptr<pack_prefetcher> pack::current_prefetcher() const {
+	lock_guard lock(prefetcher_mutex);
+	return prefetcher;
 }
 
-string pack::get_file_name(const int64_t idx) {
-	for (const auto& [name, entry] : entry_cache)
-		if (entry.rowid == idx) return name;
-	return "";
+void pack::replace_prefetcher(shared_ptr<pack_prefetcher> replacement) {
+	{
+		lock_guard lock(prefetcher_mutex);
+		prefetcher.swap(replacement);
+	}
+	// The old prefetcher joins its workers once the last reader lets go of it, outside the lock.
 }
 
-void pack::list_files(vector<string>& files) {
-	files.reserve(files.size() + entry_cache.size());
-	for (const auto& [name, entry] : entry_cache) files.emplace_back(name);
+void pack::prefetch(CScriptArray* names, const int priority) {
+	if (!names) return;
+	vector<string> requested;
+	requested.reserve(names->GetSize());
+	for (asUINT i = 0; i < names->GetSize(); i++) requested.push_back(*static_cast<const string*>(names->At(i)));
+	prefetch(requested, priority);
 }
 
-int64_t pack::get_file_count() {
-	return static_cast<int64_t>(entry_cache.size());
+void pack::poll_prefetch(vector<string>& names) {
+	if (prefetcher) prefetcher->take_completed(names);
 }
 
-CScriptArray* pack::list_files() {
+CScriptArray* pack::poll_prefetch() {
+	vector<string> names;
+	poll_prefetch(names);
 	asIScriptContext* ctx = asGetActiveContext();
 	asIScriptEngine* engine = ctx->GetEngine();
-	CScriptArray* array = CScriptArray::Create(engine->GetTypeInfoByDecl("array<string>"));
-	array->Reserve(static_cast<asUINT>(entry_cache.size()));
-	for (const auto& [name, entry] : entry_cache) {
-		string n = name;
-		array->InsertLast(&n);
-	}
+	CScriptArray* array = CScriptArray::Create(engine->GetTypeInfoByDecl("array<string>"), static_cast<asUINT>(names.size()));
+	for (asUINT i = 0; i < names.size(); i++) static_cast<string*>(array->At(i))->swap(names[i]);
 	return array;
 }
 
-uint64_t pack::get_file_size(const string& pack_filename) {
-	auto it = entry_cache.find(pack_filename);
-	return it != entry_cache.end() ? it->second.size : 0;
+void pack::cancel_prefetch() {
+	if (prefetcher) prefetcher->clear();
 }
 
-int64_t pack::get_rowid(const string& filename) const {
-	auto it = entry_cache.find(filename);
-	return it != entry_cache.end() ? it->second.rowid : 0;
+uint64_t pack::get_prefetch_pending() const {
+	return prefetcher ? prefetcher->pending() : 0;
 }
 
-unsigned int pack::read_file(const string& pack_filename, unsigned int offset, unsigned char* buffer, unsigned int size) {
-	const auto rowid = get_rowid(pack_filename);
-	if (!rowid) return 0;
-	sqlite3_blob* blob;
-	if (const auto rc = sqlite3_blob_open(db, "main", "pack_files", "data", rowid, 0, &blob); rc != SQLITE_OK)
-		throw runtime_error(Poco::format("Internal error: %s", string(sqlite3_errmsg(db))));
-	const auto blob_size = static_cast<unsigned>(sqlite3_blob_bytes(blob));
-	if (offset >= blob_size || (offset + size) > blob_size) { sqlite3_blob_close(blob); return 0; }
-	if (const auto rc = sqlite3_blob_read(blob, buffer, size, offset); rc != SQLITE_OK) {
-		sqlite3_blob_close(blob);
-		throw runtime_error(Poco::format("Internal error: %s", string(sqlite3_errmsg(db))));
+void pack::set_prefetch_cache_limit(const uint64_t limit) {
+	prefetch_cache_limit = limit;
+	if (prefetcher) prefetcher->set_byte_limit(limit);
+}
+
+void pack::set_prefetch_threads(const unsigned int threads) {
+	if (threads == 0) throw invalid_argument("Prefetching needs at least one thread");
+	prefetch_threads = threads;
+	// Workers are started with the prefetcher, so restart it on the next prefetch.
+	replace_prefetcher(nullptr);
+}
+
+void pack::read_entry(sqlite3_blob* blob, const pack_entry& entry, uint64_t offset, void* buffer, uint64_t size) const {
+	if (entry.codec == PackCodec::None) {
+		if (const auto rc = sqlite3_blob_read(blob, buffer, static_cast<int>(size), static_cast<int>(offset)); rc != SQLITE_OK)
+			throw runtime_error(Poco::format("Internal error: %s", string(sqlite3_errmsg(db))));
+	} else read_compressed(blob, entry.codec, *get_frame_index(entry), entry.size, offset, static_cast<char*>(buffer), size);
+}
+
+vector<optional<string>> pack::read_files(const vector<string>& names) const {
+	vector<optional<string>> result(names.size());
+	// Entries are copied because a lazily loading cache may land mid-lookup and drop the pending entries earlier pointers refer to.
+	vector<pair<pack_entry, size_t>> order;
+	order.reserve(names.size());
+	for (size_t i = 0; i < names.size(); i++) {
+		const auto entry = find_entry(names[i]);
+		if (!entry) continue;
+		note_access(names[i]);
+		pack_entry copy = *entry;
+		copy.name = names[i];
+		order.emplace_back(copy, i);
 	}
-	sqlite3_blob_close(blob);
+	// Rowid order is each table's b-tree order, which is as close to sequential I/O as SQLite lets us get. Entries sharing deduplicated content end up adjacent and are read once.
+	ranges::sort(order, [](const auto& a, const auto& b) { return make_pair(a.first.content != 0, a.first.data_rowid()) < make_pair(b.first.content != 0, b.first.data_rowid()); });
+	for (size_t i = 0; i < order.size(); i++) {
+		const auto& [entry, index] = order[i];
+		if (i > 0 && order[i - 1].first.data_key() == entry.data_key()) {
+			result[index] = result[order[i - 1].second];
+			continue;
+		}
+		string& data = result[index].emplace(entry.size, '\0');
+		read_entry_direct(entry, 0, data.data(), entry.size);
+	}
+	return result;
+}
+
+CScriptDictionary* pack::read_files(CScriptArray* names) const {
+	asIScriptContext* ctx = asGetActiveContext();
+	asIScriptEngine* engine = ctx->GetEngine();
+	const int string_type = engine->GetTypeIdByDecl("string");
+	vector<string> requested;
+	if (names) {
+		requested.reserve(names->GetSize());
+		for (asUINT i = 0; i < names->GetSize(); i++) requested.push_back(*static_cast<const string*>(names->At(i)));
+	}
+	auto payloads = read_files(requested);
+	CScriptDictionary* d = CScriptDictionary::Create(engine);
+	for (size_t i = 0; i < requested.size(); i++) {
+		if (payloads[i]) d->Set(requested[i], &*payloads[i], string_type);
+	}
+	return d;
+}
+
+unsigned int pack::read_file(const string& pack_filename, unsigned int offset, unsigned char* buffer, unsigned int size) {
+	const auto entry = find_entry(pack_filename);
+	if (!entry) return 0;
+	note_access(pack_filename);
+	if (offset >= entry->size || (static_cast<uint64_t>(offset) + size) > entry->size) return 0;
+	read_entry(*entry, offset, buffer, size);
 	return size;
 }
 
 string pack::read_file_string(const string& pack_filename, unsigned int offset, unsigned int size) {
-	const auto rowid = get_rowid(pack_filename);
-	if (!rowid) return "";
-	sqlite3_blob* blob;
-	if (const auto rc = sqlite3_blob_open(db, "main", "pack_files", "data", rowid, 0, &blob); rc != SQLITE_OK)
-		throw runtime_error(Poco::format("Internal error: %s", string(sqlite3_errmsg(db))));
-	const auto blob_size = static_cast<unsigned>(sqlite3_blob_bytes(blob));
-	if (offset >= blob_size || (offset + size) > blob_size) { sqlite3_blob_close(blob); return ""; }
+	const auto entry = find_entry(pack_filename);
+	if (!entry) return "";
+	note_access(pack_filename);
+	if (offset >= entry->size || (static_cast<uint64_t>(offset) + size) > entry->size) return "";
 	string res(size, '\0');
-	if (const auto rc = sqlite3_blob_read(blob, res.data(), size, offset); rc != SQLITE_OK) {
-		sqlite3_blob_close(blob);
-		throw runtime_error(Poco::format("Internal error: %s", string(sqlite3_errmsg(db))));
-	}
-	sqlite3_blob_close(blob);
+	read_entry(*entry, offset, res.data(), size);
 	return res;
 }
 
 uint64_t pack::size() {
-	uint64_t total = 0;
-	for (const auto& [_, entry] : entry_cache) total += entry.size;
-	return total;
+	ensure_entry_cache();
+	return entry_cache.total_size();
 }
 
-blob_stream pack::open_file_stream(const string& file_name, const bool rw) {
-	const auto rowid = get_rowid(file_name);
-	if (!rowid) throw ios_base::failure(Poco::format("File %s does not exist", file_name));
-	return blob_stream(db, "main", "pack_files", "data", rowid, rw);
+iostream* pack::open_file_stream(const string& file_name, const bool rw) {
+	// Cached and prefetched copies would hide whatever gets written through the stream.
+	if (rw) begin_write();
+	const auto entry = find_entry(file_name);
+	if (!entry) throw ios_base::failure(Poco::format("File %s does not exist", file_name));
+	if (!rw) note_access(file_name);
+	if (rw && entry->content) throw ios_base::failure(Poco::format("File %s shares its content with other files and cannot be opened for writing", file_name));
+	if (entry->codec == PackCodec::None) return new blob_stream(db, "main", entry->data_table(), "data", entry->data_rowid(), rw);
+	if (rw) throw ios_base::failure(Poco::format("File %s is compressed and cannot be opened for writing", file_name));
+	auto stream = make_unique<blob_stream>();
+	stream->open_compressed(db, "main", entry->data_table(), "data", entry->data_rowid(), entry->codec, get_frame_index(*entry), entry->size);
+	return stream.release();
 }
 
 void pack::allocate_file(const string& file_name, const int64_t size, const bool allow_replace) {
+	begin_write();
 	if (file_exists(file_name)) {
 		if (allow_replace) delete_file(file_name);
 		else throw runtime_error(Poco::format("Could not allocate file %s because it already exists", file_name));
 	}
-	auto stmt = prepare_stmt(db, "insert into pack_files values(?, ?)");
+	stmt_guard stmt(cached_stmt(INSERT_FILE_SQL), true);
 	bind_text(db, stmt, 1, file_name);
-	if (const auto rc = sqlite3_bind_zeroblob64(stmt, 2, size); rc != SQLITE_OK) {
-		sqlite3_finalize(stmt);
+	if (const auto rc = sqlite3_bind_zeroblob64(stmt, 2, size); rc != SQLITE_OK)
 		throw runtime_error(Poco::format("Internal error: %s", string(sqlite3_errmsg(db))));
-	}
 	query_rows(db, stmt, [](sqlite3_stmt*) {});
 	const int64_t rowid = sqlite3_last_insert_rowid(db);
-	entry_cache.emplace(file_name, pack_entry{file_name, static_cast<uint64_t>(size), rowid});
+	frame_index_cache.erase(rowid);
+	cache_put(pack_entry{file_name, static_cast<uint64_t>(size), rowid});
 }
 
 bool pack::rename_file(const string& old, const string& new_) {
+	begin_write();
 	if (!file_exists(old)) return false;
-	auto stmt = prepare_stmt(db, "update pack_files set file_name = ? where file_name = ?");
+	stmt_guard stmt(cached_stmt("update pack_files set file_name = ? where file_name = ?"), true);
 	bind_text(db, stmt, 1, new_);
 	bind_text(db, stmt, 2, old);
 	query_rows(db, stmt, [](sqlite3_stmt*) {});
-	auto node = entry_cache.extract(old);
-	if (!node.empty()) { node.key() = new_; node.mapped().name = new_; entry_cache.insert(std::move(node)); }
+	pack_entry entry = *find_entry(old);
+	cache_erase(old);
+	entry.name = new_;
+	cache_put(entry);
 	return true;
 }
 
+int64_t pack::merge_from(const string& filename, const string& key, const MergePolicy policy) {
+	begin_write();
+	{
+		// Always pass a key: without one, ATTACH reuses the main database's key, which would fail for an unencrypted source.
+		stmt_guard attach(prepare_stmt(db, "attach database ? as merge_source key ?"));
+		bind_text(db, attach, 1, filename);
+		bind_text(db, attach, 2, key);
+		query_rows(db, attach, [](sqlite3_stmt*) {});
+	}
+	int64_t merged = 0;
+	try {
+		if (!table_has_column(db, "pack_files", "file_name", "merge_source")) throw runtime_error(Poco::format("%s is not a pack", filename));
+		const bool source_has_codec = table_has_column(db, "pack_files", "codec", "merge_source");
+		const bool source_has_content = table_has_column(db, "pack_files", "content", "merge_source");
+		int64_t last_rowid = 0;
+		{
+			stmt_guard stmt(prepare_stmt(db, "select coalesce(max(rowid), 0) from main.pack_files"));
+			query_rows(db, stmt, [&](sqlite3_stmt* s) { last_rowid = sqlite3_column_int64(s, 0); });
+		}
+		const char* verb = policy == MergePolicy::Replace ? "insert or replace" : policy == MergePolicy::Skip ? "insert or ignore" : "insert";
+		// Deduplicated source entries are copied out in full; sharing is not carried across packs.
+		const char* columns = source_has_content ? "f.file_name, coalesce(c.data, f.data), coalesce(c.codec, f.codec), coalesce(c.size, f.size), coalesce(c.frames, f.frames) from merge_source.pack_files f left join merge_source.pack_content c on c.id = f.content order by f.rowid" : source_has_codec ? "file_name, data, codec, size, frames from merge_source.pack_files order by rowid" : "file_name, data, 0, null, null from merge_source.pack_files order by rowid";
+		const string sql = Poco::format("%s into main.pack_files(file_name, data, codec, size, frames) select %s", string(verb), string(columns));
+		if (const auto rc = sqlite3_exec(db, "begin immediate transaction;", nullptr, nullptr, nullptr); rc != SQLITE_OK)
+			throw runtime_error(Poco::format("Could not begin transaction: %s", string(sqlite3_errmsg(db))));
+		try {
+			stmt_guard stmt(prepare_stmt(db, sql.c_str()));
+			query_rows(db, stmt, [](sqlite3_stmt*) {});
+			merged = sqlite3_changes64(db);
+			if (const auto rc = sqlite3_exec(db, "commit;", nullptr, nullptr, nullptr); rc != SQLITE_OK)
+				throw runtime_error(Poco::format("Could not commit transaction: %s", string(sqlite3_errmsg(db))));
+		} catch (...) {
+			if (!sqlite3_get_autocommit(db)) sqlite3_exec(db, "rollback;", nullptr, nullptr, nullptr);
+			throw;
+		}
+		// New rows are appended past the old highest rowid, so only those need loading. Names they replaced are erased first so their frame indexes are dropped too.
+		stmt_guard stmt(prepare_stmt(db, "select id, file_name, size, codec, content from pack_entries where id > ?"));
+		sqlite3_bind_int64(stmt, 1, last_rowid);
+		query_rows(db, stmt, [&](sqlite3_stmt* s) {
+			const string name = column_string(s, 1);
+			cache_erase(name);
+			cache_put(column_entry(s, name));
+		});
+	} catch (...) {
+		sqlite3_exec(db, "detach database merge_source;", nullptr, nullptr, nullptr);
+		throw;
+	}
+	sqlite3_exec(db, "detach database merge_source;", nullptr, nullptr, nullptr);
+	return merged;
+}
+
+void pack::note_access(const string& name) const {
+	if (!trace_access) return;
+	lock_guard lock(access_mutex);
+	if (access_seen.insert(name).second) access_log.push_back(name);
+}
+
+void pack::get_access_log(vector<string>& names) const {
+	lock_guard lock(access_mutex);
+	names = access_log;
+}
+
+CScriptArray* pack::get_access_log() const {
+	vector<string> names;
+	get_access_log(names);
+	asIScriptContext* ctx = asGetActiveContext();
+	asIScriptEngine* engine = ctx->GetEngine();
+	CScriptArray* array = CScriptArray::Create(engine->GetTypeInfoByDecl("array<string>"), static_cast<asUINT>(names.size()));
+	for (asUINT i = 0; i < names.size(); i++) static_cast<string*>(array->At(i))->swap(names[i]);
+	return array;
+}
+
+void pack::clear_access_log() {
+	lock_guard lock(access_mutex);
+	access_log.clear();
+	access_seen.clear();
+}
+
+// Stored payloads up to about a page are kept inline in b-tree leaves, so grouping them packs many into each page read.
+static constexpr int OPTIMIZE_SMALL_ENTRY = 4096;
+
+void pack::optimize(const vector<string>& order) {
+	if (sqlite3_db_readonly(db, "main") != 0) throw runtime_error("Cannot optimize a read-only pack");
+	if (!sqlite3_get_autocommit(db)) throw runtime_error("Cannot optimize a pack inside a transaction");
+	begin_write();
+	replace_read_pool(nullptr);
+	// The tables are about to be dropped, which cached statements would otherwise hold open.
+	finalize_stmt_cache();
+	frame_index_cache.clear();
+	if (const auto rc = sqlite3_exec(db, "begin immediate transaction;", nullptr, nullptr, nullptr); rc != SQLITE_OK)
+		throw runtime_error(Poco::format("Could not begin transaction: %s", string(sqlite3_errmsg(db))));
+	try {
+		if (const auto rc = sqlite3_exec(db, "create temp table pack_access_order(file_name primary key, position integer not null);", nullptr, nullptr, nullptr); rc != SQLITE_OK)
+			throw runtime_error(Poco::format("Could not record access order: %s", string(sqlite3_errmsg(db))));
+		{
+			stmt_guard stmt(prepare_stmt(db, "insert or ignore into temp.pack_access_order(file_name, position) values(?, ?)"));
+			for (size_t i = 0; i < order.size(); i++) {
+				bind_text(db, stmt, 1, order[i]);
+				sqlite3_bind_int64(stmt, 2, static_cast<sqlite3_int64>(i));
+				query_rows(db, stmt, [](sqlite3_stmt*) {});
+			}
+		}
+		// Entries go in access order, then the untraced ones with small entries together, each new rowid following the last. Deduplicated content follows its first reader.
+		// Dropping the tables skips their delete triggers, so reference counts and the manifest carry over unchanged, and content no entry references is left behind.
+		const string sql = Poco::format("create temp table pack_entry_order as select f.rowid as old_id, row_number() over (order by o.position is null, o.position, length(coalesce(c.data, f.data)) > %d, f.file_name) as position from pack_files f left join temp.pack_access_order o on o.file_name = f.file_name left join pack_content c on c.id = f.content;"
+			"create temp table pack_content_order as select f.content as old_id, row_number() over (order by min(e.position)) as new_id from pack_files f join temp.pack_entry_order e on e.old_id = f.rowid where f.content is not null group by f.content;"
+			"drop view if exists temp.pack_entries;"
+			"create table pack_content_rebuild(%s);"
+			"insert into pack_content_rebuild(id, hash, data, codec, size, frames, refs) select m.new_id, c.hash, c.data, c.codec, c.size, c.frames, c.refs from temp.pack_content_order m join pack_content c on c.id = m.old_id order by m.new_id;"
+			"create table pack_files_rebuild(%s);"
+			"insert into pack_files_rebuild(file_name, data, codec, size, frames, content) select f.file_name, f.data, f.codec, f.size, f.frames, m.new_id from temp.pack_entry_order e join pack_files f on f.rowid = e.old_id left join temp.pack_content_order m on m.old_id = f.content order by e.position;"
+			"drop table pack_files; drop table pack_content;"
+			"alter table pack_files_rebuild rename to pack_files; alter table pack_content_rebuild rename to pack_content;"
+			"drop table temp.pack_access_order; drop table temp.pack_entry_order; drop table temp.pack_content_order;", OPTIMIZE_SMALL_ENTRY, string(PACK_CONTENT_COLUMNS), string(PACK_FILES_COLUMNS));
+		if (const auto rc = sqlite3_exec(db, sql.c_str(), nullptr, nullptr, nullptr); rc != SQLITE_OK)
+			throw runtime_error(Poco::format("Could not rebuild pack tables: %s", string(sqlite3_errmsg(db))));
+		create_pack_schema(db);
+		create_entry_view(db);
+		if (const auto rc = sqlite3_exec(db, "commit;", nullptr, nullptr, nullptr); rc != SQLITE_OK)
+			throw runtime_error(Poco::format("Could not commit transaction: %s", string(sqlite3_errmsg(db))));
+	} catch (...) {
+		if (!sqlite3_get_autocommit(db)) sqlite3_exec(db, "rollback;", nullptr, nullptr, nullptr);
+		load_entry_cache();
+		start_read_pool();
+		throw;
+	}
+	// Every rowid changed, so copies must reload their entries before trusting them again.
+	{
+		lock_guard lock(entry_mutex);
+		loaded_rowid_epoch = ++*rowid_epoch;
+		load_entry_cache();
+	}
+	// VACUUM rewrites the file in b-tree order, so the new rowid order becomes the order of pages on disk.
+	if (const auto rc = sqlite3_exec(db, "vacuum;", nullptr, nullptr, nullptr); rc != SQLITE_OK) {
+		const string error = sqlite3_errmsg(db);
+		start_read_pool();
+		throw runtime_error(Poco::format("Could not vacuum pack: %s", error));
+	}
+	start_read_pool();
+}
+
+void pack::optimize_script(CScriptArray* order) {
+	vector<string> names;
+	if (order) {
+		names.reserve(order->GetSize());
+		for (asUINT i = 0; i < order->GetSize(); i++) names.push_back(*static_cast<const string*>(order->At(i)));
+	} else get_access_log(names);
+	optimize(names);
+}
+
 void pack::clear() {
-	auto stmt = prepare_stmt(db, "delete from pack_files");
+	begin_write();
+	stmt_guard stmt(cached_stmt("delete from pack_files"), true);
 	query_rows(db, stmt, [](sqlite3_stmt*) {});
-	entry_cache.clear();
+	cache_clear();
+}
+
+// The leading part of a LIKE or GLOB pattern before its first wildcard. LIKE folds ASCII case, so its prefix is only usable for narrowing while it holds no letters.
+static string_view pattern_prefix(string_view pattern, const FindMode mode) {
+	const auto wildcard = pattern.find_first_of(mode == FindMode::Glob ? "*?[" : "%_");
+	auto prefix = pattern.substr(0, wildcard);
+	if (mode == FindMode::Like) {
+		const auto letter = ranges::find_if(prefix, [](unsigned char c) { return isalpha(c); });
+		prefix = prefix.substr(0, letter - prefix.begin());
+	}
+	return prefix;
+}
+
+void pack::find(const string& what, vector<string>& files, const FindMode mode) const {
+	ensure_entry_cache();
+	const auto& names = entry_cache.sorted_names();
+	if (mode == FindMode::Regexp) {
+		Poco::RegularExpression re(what, Poco::RegularExpression::RE_EXTRA | Poco::RegularExpression::RE_NOTEMPTY | Poco::RegularExpression::RE_UTF8 | Poco::RegularExpression::RE_NO_UTF8_CHECK | Poco::RegularExpression::RE_NEWLINE_ANY);
+		Poco::RegularExpression::Match match;
+		for (const auto name : names) {
+			const string n(name);
+			re.match(n, match);
+			if (match.offset != string::npos || match.length != 0) files.push_back(n);
+		}
+		return;
+	}
+	const auto [first, last] = prefix_range(names, pattern_prefix(what, mode));
+	for (auto it = first; it != last; ++it) {
+		const string n(*it);
+		const bool matched = mode == FindMode::Glob ? sqlite3_strglob(what.c_str(), n.c_str()) == 0 : sqlite3_strlike(what.c_str(), n.c_str(), 0) == 0;
+		if (matched) files.push_back(n);
+	}
 }
 
 CScriptArray* pack::find(const string& what, const FindMode mode) {
+	vector<string> files;
+	find(what, files, mode);
 	asIScriptContext* ctx = asGetActiveContext();
 	asIScriptEngine* engine = ctx->GetEngine();
-	CScriptArray* array = CScriptArray::Create(engine->GetTypeInfoByDecl("array<string>"));
-	static const char* queries[] = {
-		"select file_name from pack_files where file_name like ?",
-		"select file_name from pack_files where file_name glob ?",
-		"select file_name from pack_files where file_name regexp ?"
-	};
-	auto stmt = prepare_stmt(db, queries[static_cast<int>(mode)]);
-	bind_text(db, stmt, 1, what);
-	query_rows(db, stmt, [&](sqlite3_stmt* s) {
-		string res = column_string(s, 0);
-		array->InsertLast(&res);
-	});
+	CScriptArray* array = CScriptArray::Create(engine->GetTypeInfoByDecl("array<string>"), static_cast<asUINT>(files.size()));
+	for (asUINT i = 0; i < files.size(); i++) static_cast<string*>(array->At(i))->swap(files[i]);
 	return array;
 }
 
@@ -445,6 +2065,7 @@ CScriptArray* pack::exec(const string& sql) {
 	asIScriptContext* ctx = asGetActiveContext();
 	asIScriptEngine* engine = ctx->GetEngine();
 	CScriptArray* array = CScriptArray::Create(engine->GetTypeInfoByDecl("array<dictionary@>"));
+	begin_write();
 	char* errmsg;
 	if (const auto rc = sqlite3_exec(db, sql.data(), [](void* arr, int column_count, char** column_data, char** columns) -> int {
 		CScriptArray* array = (CScriptArray*)arr;
@@ -469,17 +2090,59 @@ CScriptArray* pack::exec(const string& sql) {
 }
 
 void* pack::open_file(const string& file_name, const bool rw) {
-	return nvgt_datastream_create(new blob_stream(open_file_stream(file_name, rw)), "", 1);
+	return nvgt_datastream_create(open_file_stream(file_name, rw), "", 1);
 }
 
 istream* pack::get_file(const string& filename) const {
 	try {
-		return new blob_stream(const_cast<pack*>(this)->open_file_stream(filename, false));
+		const auto entry = lookup_entry(filename);
+		if (!entry) return nullptr;
+		note_access(filename);
+		shared_ptr<pack_read_pool> pool;
+		{
+			lock_guard lock(read_pool_mutex);
+			pool = read_pool;
+		}
+		// Pooled connections only see committed data.
+		if (pool && sqlite3_get_autocommit(db)) return open_entry_stream(*entry, pool->acquire());
+		return open_entry_stream(*entry, nullptr);
 	} catch (exception&) {
 		return nullptr;
 	}
 }
 
+istream* pack::open_entry_stream(const pack_entry& entry, shared_ptr<sqlite3> pooled) const {
+	sqlite3* connection = pooled ? pooled.get() : db;
+	if (auto payload = find_decoded(entry, connection)) return new shared_payload_stream(std::move(payload));
+	if (entry.codec == PackCodec::None && entry.size <= mapped_view_limit) return new pack_view_stream(pooled ? new pack_view(std::move(pooled), entry) : new pack_view(db, entry));
+	auto stream = make_unique<blob_stream>();
+	if (entry.codec == PackCodec::None) stream->open(connection, "main", entry.data_table(), "data", entry.data_rowid(), false);
+	else stream->open_compressed(connection, "main", entry.data_table(), "data", entry.data_rowid(), entry.codec, entry_reader(connection).get_frame_index(entry), entry.size);
+	if (pooled) stream->rdbuf()->keep_connection(std::move(pooled));
+	return stream.release();
+}
+
+void pack::start_read_pool() {
+	replace_read_pool(nullptr);
+	// Exclusive locking would keep pooled connections out.
+	if (!db || read_pool_size == 0 || get_profile_settings(profile).exclusive) return;
+	const auto filename = sqlite3_filename_database(sqlite3_db_filename(db, "main"));
+	if (!filename || !*filename) return;
+	// Pooled readers share the entry cache, which must not change under them as a lazy load lands.
+	ensure_entry_cache();
+	replace_read_pool(make_shared<pack_read_pool>(filename, pack_key, profile, read_pool_size));
+}
+
+void pack::replace_read_pool(shared_ptr<pack_read_pool> replacement) {
+	lock_guard lock(read_pool_mutex);
+	read_pool.swap(replacement);
+}
+
+void pack::set_read_pool_size(const unsigned int size) {
+	read_pool_size = size;
+	start_read_pool();
+}
+
 sqlite3* pack::get_db_ptr() const {
 	if (!db) throw runtime_error("DB pointer is null!");
 	return db;
@@ -495,27 +2158,142 @@ const string pack::get_pack_name() const {
 }
 
 bool pack::extract_file(const string& internal_name, const string& file_on_disk) {
-	const auto rowid = get_rowid(internal_name);
-	if (!rowid) return false;
-	sqlite3_blob* blob;
-	if (const auto rc = sqlite3_blob_open(db, "main", "pack_files", "data", rowid, 0, &blob); rc != SQLITE_OK)
-		throw runtime_error(string(sqlite3_errmsg(db)));
-	ofstream stream(file_on_disk, ios::out | ios::binary);
-	if (!stream) { sqlite3_blob_close(blob); return false; }
-	array<char, 4096> buffer;
-	int offset = 0;
-	const int blob_size = sqlite3_blob_bytes(blob);
-	while (offset < blob_size) {
-		const int to_read = min(static_cast<int>(buffer.size()), blob_size - offset);
-		if (const auto rc = sqlite3_blob_read(blob, buffer.data(), to_read, offset); rc != SQLITE_OK) {
-			sqlite3_blob_close(blob);
-			throw runtime_error(string(sqlite3_errmsg(db)));
+	const auto entry = find_entry(internal_name);
+	if (!entry) return false;
+	const pack_entry copy = *entry;
+	entry_reader extractor(db);
+	return extractor.extract(copy, file_on_disk);
+}
+
+// Resolves an entry name below dest, refusing absolute names and any that climb out with "..".
+static filesystem::path extract_destination(const filesystem::path& dest, const string& name) {
+	const auto relative = filesystem::path(name).lexically_normal();
+	if (relative.empty() || relative.has_root_path() || *relative.begin() == "..") throw runtime_error(Poco::format("Refusing to extract %s outside the destination directory", name));
+	return dest / relative;
+}
+
+uint64_t pack::extract_all(const string& dest_dir, const string& pattern, unsigned int thread_count, const progress_callback& progress) {
+	vector<string> names;
+	find(pattern, names, FindMode::Like);
+	vector<pack_entry> entries;
+	entries.reserve(names.size());
+	for (const auto& name : names) {
+		const auto entry = find_entry(name);
+		if (!entry) continue;
+		entries.push_back(*entry);
+		entries.back().name = name;
+	}
+	// Table and rowid order keeps each worker's reads close to sequential.
+	ranges::sort(entries, [](const pack_entry& a, const pack_entry& b) { return make_pair(a.content != 0, a.data_rowid()) < make_pair(b.content != 0, b.data_rowid()); });
+	const filesystem::path dest(dest_dir);
+	vector<string> targets;
+	targets.reserve(entries.size());
+	for (const auto& entry : entries) {
+		const auto target = extract_destination(dest, string(entry.name));
+		filesystem::create_directories(target.parent_path());
+		targets.push_back(target.string());
+	}
+	// Workers read through private connections, which can only see committed data of a file-backed pack; otherwise extract on the pack's own connection.
+	const auto filename = sqlite3_filename_database(sqlite3_db_filename(db, "main"));
+	if (!filename || !*filename || !sqlite3_get_autocommit(db) || get_profile_settings(profile).exclusive) thread_count = 1;
+	else if (thread_count == 0) thread_count = max(1u, thread::hardware_concurrency());
+	thread_count = static_cast<unsigned int>(min<size_t>(thread_count, max<size_t>(entries.size(), 1)));
+	if (thread_count == 1) {
+		release_blob_pool();
+		entry_reader extractor(db);
+		for (size_t i = 0; i < entries.size(); i++) {
+			if (!extractor.extract(entries[i], targets[i])) throw runtime_error(Poco::format("Could not write %s", targets[i]));
+			if (progress) progress(string(entries[i].name), i + 1, entries.size());
 		}
-		stream.write(buffer.data(), to_read);
-		offset += to_read;
+		return entries.size();
 	}
-	sqlite3_blob_close(blob);
-	return !stream.bad() && !stream.fail();
+	atomic<size_t> next(0);
+	atomic<bool> failed(false);
+	mutex done_mutex;
+	condition_variable done_cv;
+	vector<size_t> done;
+	unsigned int running = thread_count;
+	exception_ptr error;
+	vector<thread> workers;
+	workers.reserve(thread_count);
+	for (unsigned int t = 0; t < thread_count; t++) workers.emplace_back([&, filename] {
+		sqlite3* conn = nullptr;
+		try {
+			if (sqlite3_open_v2(filename, &conn, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX | SQLITE_OPEN_EXRESCODE, nullptr) != SQLITE_OK) throw runtime_error(Poco::format("Could not open %s: %s", string(filename), string(sqlite3_errmsg(conn))));
+			setup_db_read(conn, pack_key, profile);
+			entry_reader extractor(conn);
+			for (size_t i = next++; i < entries.size() && !failed; i = next++) {
+				if (!extractor.extract(entries[i], targets[i])) throw runtime_error(Poco::format("Could not write %s", targets[i]));
+				lock_guard lock(done_mutex);
+				done.push_back(i);
+				done_cv.notify_one();
+			}
+		} catch (...) {
+			lock_guard lock(done_mutex);
+			if (!error) error = current_exception();
+			failed = true;
+		}
+		sqlite3_close(conn);
+		lock_guard lock(done_mutex);
+		running--;
+		done_cv.notify_one();
+	});
+	// Progress is reported from the calling thread, as script callbacks must be.
+	uint64_t reported = 0;
+	vector<size_t> batch;
+	for (;;) {
+		{
+			unique_lock lock(done_mutex);
+			done_cv.wait(lock, [&] { return !done.empty() || running == 0; });
+			batch.swap(done);
+			if (batch.empty() && running == 0) break;
+		}
+		for (const auto i : batch) {
+			reported++;
+			if (progress && !failed) {
+				try {
+					progress(string(entries[i].name), reported, entries.size());
+				} catch (...) {
+					lock_guard lock(done_mutex);
+					if (!error) error = current_exception();
+					failed = true;
+				}
+			}
+		}
+		batch.clear();
+	}
+	for (auto& w : workers) w.join();
+	if (error) rethrow_exception(error);
+	return entries.size();
+}
+
+uint64_t pack::extract_all_script(const string& dest_dir, const string& pattern, unsigned int thread_count, asIScriptFunction* progress) {
+	const auto cb = script_progress_callback(progress);
+	try {
+		const auto ret = extract_all(dest_dir, pattern, thread_count, cb);
+		if (progress) progress->Release();
+		return ret;
+	} catch (...) {
+		if (progress) progress->Release();
+		throw;
+	}
+}
+
+pack_view* pack::map_file(const string& file_name) const {
+	const auto entry = find_entry(file_name);
+	if (!entry) throw ios_base::failure(Poco::format("File %s does not exist", file_name));
+	if (entry->codec != PackCodec::None) throw ios_base::failure(Poco::format("File %s is compressed and cannot be mapped", file_name));
+	note_access(file_name);
+	return new pack_view(db, *entry);
+}
+
+void* pack::map_file_script(const string& file_name) {
+	return nvgt_datastream_create(new pack_view_stream(map_file(file_name)), "", 1);
+}
+
+void pack::set_compression_frame_size(const uint32_t size) {
+	if (size < MIN_PACK_FRAME_SIZE || size > MAX_PACK_FRAME_SIZE) throw invalid_argument(Poco::format("Frame size must be between %u and %u bytes", MIN_PACK_FRAME_SIZE, MAX_PACK_FRAME_SIZE));
+	compression_frame_size = size;
 }
 
 void pack::set_key(const string& key) { pack_key = key; }
@@ -536,9 +2314,307 @@ const pack_interface* pack::get_mutable() const {
 	return this;
 }
 
+// --- pack_view ---
+
+pack_view::pack_view(shared_ptr<sqlite3> pooled, const pack_entry& entry) : pack_view(pooled.get(), entry) {
+	connection = std::move(pooled);
+}
+
+pack_view::pack_view(sqlite3* db, const pack_entry& entry) : stmt(nullptr), ptr(nullptr), len(0) {
+	stmt = prepare_stmt(db, entry.content ? "select data from pack_content where id = ?" : "select data from pack_files where rowid = ?");
+	if (const auto rc = sqlite3_bind_int64(stmt, 1, entry.data_rowid()); rc != SQLITE_OK) {
+		sqlite3_finalize(stmt);
+		throw runtime_error(Poco::format("Internal error: %s", string(sqlite3_errmsg(db))));
+	}
+	if (const auto rc = sqlite3_step(stmt); rc != SQLITE_ROW) {
+		sqlite3_finalize(stmt);
+		throw runtime_error(Poco::format("Could not map entry: %s", string(sqlite3_errmsg(db))));
+	}
+	// The order matters: sqlite3_column_bytes after sqlite3_column_blob cannot trigger a type conversion that would invalidate the pointer.
+	ptr = static_cast<const unsigned char*>(sqlite3_column_blob(stmt, 0));
+	len = static_cast<uint64_t>(sqlite3_column_bytes(stmt, 0));
+}
+
+pack_view::~pack_view() {
+	if (stmt) sqlite3_finalize(stmt);
+}
+
+pack_view_stream::pack_view_stream(pack_view* v) : pack_view_holder(v), Poco::MemoryInputStream(reinterpret_cast<const char*>(v->data()), static_cast<streamsize>(v->size())) {}
+
+shared_payload_stream::shared_payload_stream(shared_ptr<const string> p) : shared_payload_holder(std::move(p)), Poco::MemoryInputStream(payload->data(), static_cast<streamsize>(payload->size())) {}
+
+// --- entry_lru ---
+
+bool entry_lru::accepts(const uint64_t size) const {
+	lock_guard lock(mutex);
+	return size <= limit / 8;
+}
+
+shared_ptr<const string> entry_lru::get(const int64_t rowid, const unsigned int version) {
+	lock_guard lock(mutex);
+	const auto it = index.find(rowid);
+	if (it == index.end() || it->second->version != version) {
+		misses++;
+		return nullptr;
+	}
+	hits++;
+	order.splice(order.begin(), order, it->second);
+	return it->second->data;
+}
+
+void entry_lru::put(const int64_t rowid, shared_ptr<const string> data, const uint64_t read_generation, const unsigned int version) {
+	lock_guard lock(mutex);
+	if (read_generation != generation || data->size() > limit / 8) return;
+	if (const auto it = index.find(rowid); it != index.end()) {
+		if (it->second->version == version) return;
+		// Bytes from an older version are never served again.
+		bytes -= it->second->data->size();
+		order.erase(it->second);
+		index.erase(it);
+	}
+	evict_to(limit - data->size());
+	bytes += data->size();
+	order.push_front(node{rowid, version, std::move(data)});
+	index.emplace(rowid, order.begin());
+}
+
+void entry_lru::evict_to(const uint64_t target) {
+	while (bytes > target && !order.empty()) {
+		bytes -= order.back().data->size();
+		index.erase(order.back().rowid);
+		order.pop_back();
+		evictions++;
+	}
+}
+
+void entry_lru::clear() {
+	lock_guard lock(mutex);
+	order.clear();
+	index.clear();
+	bytes = 0;
+	generation++;
+}
+
+uint64_t entry_lru::get_generation() const {
+	lock_guard lock(mutex);
+	return generation;
+}
+
+uint64_t entry_lru::get_limit() const {
+	lock_guard lock(mutex);
+	return limit;
+}
+
+void entry_lru::set_limit(const uint64_t byte_limit) {
+	lock_guard lock(mutex);
+	limit = byte_limit;
+	evict_to(limit);
+}
+
+uint64_t entry_lru::get_bytes() const {
+	lock_guard lock(mutex);
+	return bytes;
+}
+
+uint64_t entry_lru::get_hits() const {
+	lock_guard lock(mutex);
+	return hits;
+}
+
+uint64_t entry_lru::get_misses() const {
+	lock_guard lock(mutex);
+	return misses;
+}
+
+uint64_t entry_lru::get_evictions() const {
+	lock_guard lock(mutex);
+	return evictions;
+}
+
+// --- pack_read_pool ---
+
+pack_read_pool::pack_read_pool(const string& file, const string& pack_key, const PackProfile pack_profile, const size_t limit) : filename(file), key(pack_key), profile(pack_profile), max_idle(limit) {}
+
+pack_read_pool::~pack_read_pool() {
+	for (auto db : idle) sqlite3_close(db);
+}
+
+shared_ptr<sqlite3> pack_read_pool::acquire() {
+	sqlite3* db = nullptr;
+	{
+		lock_guard lock(mutex);
+		if (!idle.empty()) {
+			db = idle.back();
+			idle.pop_back();
+		}
+	}
+	if (!db) {
+		// NOMUTEX is safe as a connection only ever has one holder.
+		if (sqlite3_open_v2(filename.c_str(), &db, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX | SQLITE_OPEN_EXRESCODE, nullptr) != SQLITE_OK) {
+			const string error = sqlite3_errmsg(db);
+			sqlite3_close(db);
+			throw runtime_error(Poco::format("Could not open %s: %s", filename, error));
+		}
+		try {
+			setup_db_read(db, key, profile);
+		} catch (...) {
+			sqlite3_close(db);
+			throw;
+		}
+		lock_guard lock(mutex);
+		opens++;
+	}
+	return shared_ptr<sqlite3>(db, [pool = shared_from_this()](sqlite3* connection) { pool->release(connection); });
+}
+
+void pack_read_pool::release(sqlite3* db) {
+	{
+		lock_guard lock(mutex);
+		if (idle.size() < max_idle) {
+			idle.push_back(db);
+			return;
+		}
+	}
+	sqlite3_close(db);
+}
+
+uint64_t pack_read_pool::get_opens() {
+	lock_guard lock(mutex);
+	return opens;
+}
+
+// --- pack_prefetcher ---
+
+pack_prefetcher::pack_prefetcher(const string& filename, const string& key, const unsigned int thread_count, const uint64_t limit) : byte_limit(limit) {
+	for (unsigned int i = 0; i < max(thread_count, 1u); i++) workers.emplace_back([this, filename, key]() { run(filename, key); });
+}
+
+pack_prefetcher::~pack_prefetcher() {
+	{
+		lock_guard lock(mutex);
+		stopping = true;
+	}
+	wake.notify_all();
+	for (auto& worker : workers) worker.join();
+}
+
+void pack_prefetcher::enqueue(vector<job>&& jobs) {
+	{
+		lock_guard lock(mutex);
+		for (auto& j : jobs) {
+			const auto it = loaded.find(j.data_key());
+			if (it != loaded.end() && it->second.version == j.version) continue;
+			j.sequence = next_sequence++;
+			queue.push(std::move(j));
+		}
+	}
+	wake.notify_all();
+}
+
+shared_ptr<const string> pack_prefetcher::find(const int64_t data_key, const unsigned int version) const {
+	lock_guard lock(mutex);
+	const auto it = loaded.find(data_key);
+	return it != loaded.end() && it->second.version == version ? it->second.data : nullptr;
+}
+
+void pack_prefetcher::take_completed(vector<string>& names) {
+	lock_guard lock(mutex);
+	names.insert(names.end(), make_move_iterator(completed.begin()), make_move_iterator(completed.end()));
+	completed.clear();
+}
+
+size_t pack_prefetcher::pending() const {
+	lock_guard lock(mutex);
+	return queue.size() + in_flight;
+}
+
+void pack_prefetcher::set_byte_limit(const uint64_t limit) {
+	lock_guard lock(mutex);
+	byte_limit = limit;
+}
+
+void pack_prefetcher::clear() {
+	lock_guard lock(mutex);
+	queue = {};
+	loaded.clear();
+	completed.clear();
+	loaded_bytes = 0;
+	generation++;
+}
+
+void pack_prefetcher::run(const string& filename, const string& key) {
+	// Each worker has a private connection, so no SQLite mutex is shared with the game thread.
+	sqlite3* db = nullptr;
+	sqlite3_stmt* raw_stmt = nullptr;
+	sqlite3_stmt* compressed_stmt = nullptr;
+	sqlite3_stmt* content_stmt = nullptr;
+	try {
+		if (sqlite3_open_v2(filename.c_str(), &db, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX | SQLITE_OPEN_EXRESCODE, nullptr) != SQLITE_OK) throw runtime_error(sqlite3_errmsg(db));
+		setup_db_read(db, key);
+		raw_stmt = prepare_stmt(db, "select data from pack_files where rowid = ?", SQLITE_PREPARE_PERSISTENT);
+		if (table_has_column(db, "pack_files", "frames")) compressed_stmt = prepare_stmt(db, "select data, frames from pack_files where rowid = ?", SQLITE_PREPARE_PERSISTENT);
+		if (table_has_column(db, "pack_files", "content")) content_stmt = prepare_stmt(db, "select data, frames from pack_content where id = ?", SQLITE_PREPARE_PERSISTENT);
+	} catch (exception&) {
+		// Jobs taken by this worker will simply never complete; reads fall back to the pack's own connection.
+	}
+	for (;;) {
+		job j;
+		uint64_t job_generation;
+		{
+			unique_lock lock(mutex);
+			wake.wait(lock, [this]() { return stopping || !queue.empty(); });
+			if (stopping) break;
+			j = queue.top();
+			queue.pop();
+			in_flight++;
+			job_generation = generation;
+		}
+		shared_ptr<string> payload;
+		sqlite3_stmt* stmt = j.content ? content_stmt : j.codec == PackCodec::None ? raw_stmt : compressed_stmt;
+		if (stmt) {
+			try {
+				stmt_guard guard(stmt, true);
+				sqlite3_bind_int64(stmt, 1, j.content ? j.content : j.rowid);
+				query_rows(db, stmt, [&](sqlite3_stmt* s) {
+					const auto data = sqlite3_column_blob(s, 0);
+					const auto bytes = static_cast<size_t>(sqlite3_column_bytes(s, 0));
+					if (j.codec == PackCodec::None) payload = make_shared<string>(static_cast<const char*>(data), bytes);
+					else {
+						payload = make_shared<string>(j.size, '\0');
+						decompress_entry(j.codec, data, bytes, frame_index::parse(sqlite3_column_blob(s, 1), sqlite3_column_bytes(s, 1)), j.size, payload->data());
+					}
+				});
+			} catch (exception&) {
+				payload.reset();
+			}
+		}
+		lock_guard lock(mutex);
+		in_flight--;
+		if (!payload || job_generation != generation) continue;
+		const int64_t data_key = j.data_key();
+		if (const auto it = loaded.find(data_key); it != loaded.end() && it->second.version != j.version) {
+			// A payload queued at an older version can never be served again.
+			loaded_bytes -= it->second.data->size();
+			loaded.erase(it);
+		}
+		if (!loaded.count(data_key) && loaded_bytes + payload->size() <= byte_limit) {
+			loaded_bytes += payload->size();
+			loaded.emplace(data_key, loaded_payload{j.version, std::move(payload)});
+		}
+		completed.push_back(std::move(j.name));
+	}
+	sqlite3_finalize(raw_stmt);
+	sqlite3_finalize(compressed_stmt);
+	sqlite3_finalize(content_stmt);
+	sqlite3_close(db);
+}
+
 // --- blob_stream_buf ---
 
-blob_stream_buf::blob_stream_buf(bool read_write) : Poco::BufferedBidirectionalStreamBuf(8192, read_write ? ios::in | ios::out : ios::in), read_pos(0), write_pos(0), blob(nullptr), blob_size(0) {}
+// The number of decoded frames each compressed stream keeps, enough to absorb the back and forth seeking of audio decoders probing around a frame boundary.
+static constexpr size_t STREAM_FRAME_CACHE = 4;
+
+blob_stream_buf::blob_stream_buf(bool read_write) : Poco::BufferedBidirectionalStreamBuf(8192, read_write ? ios::in | ios::out : ios::in), read_pos(0), write_pos(0), blob(nullptr), blob_size(0), codec(PackCodec::None), frame_clock(0) {}
 
 blob_stream_buf::~blob_stream_buf() {
 	if (blob) {
@@ -553,6 +2629,40 @@ void blob_stream_buf::open(sqlite3* s, const string_view& db, const string_view&
 	blob_size = sqlite3_blob_bytes(blob);
 }
 
+void blob_stream_buf::open_compressed(sqlite3* s, const string_view& db, const string_view& table, const string_view& column, const sqlite3_int64 row, PackCodec entry_codec, shared_ptr<const frame_index> entry_frames, uint64_t size) {
+	open(s, db, table, column, row, false);
+	codec = entry_codec;
+	frames = std::move(entry_frames);
+	blob_size = static_cast<int64_t>(size);
+	frame_lru.clear();
+	frame_lru.reserve(STREAM_FRAME_CACHE);
+}
+
+const string& blob_stream_buf::get_frame(size_t frame) {
+	frame_clock++;
+	for (auto& f : frame_lru) {
+		if (f.frame != frame) continue;
+		f.last_use = frame_clock;
+		return f.data;
+	}
+	if (frame >= frames->frame_count() || frames->frame_end(frame) < frames->frame_begin(frame)) throw runtime_error("Corrupt frame index");
+	decoded_frame* slot;
+	if (frame_lru.size() < STREAM_FRAME_CACHE) slot = &frame_lru.emplace_back();
+	else slot = &*min_element(frame_lru.begin(), frame_lru.end(), [](const decoded_frame& a, const decoded_frame& b) { return a.last_use < b.last_use; });
+	// Until the frame is decoded the slot must not look like a cache hit.
+	slot->frame = SIZE_MAX;
+	const auto begin = frames->frame_begin(frame);
+	const auto compressed_len = frames->frame_end(frame) - begin;
+	compressed_scratch.resize(compressed_len);
+	if (const auto rc = sqlite3_blob_read(blob, compressed_scratch.data(), static_cast<int>(compressed_len), static_cast<int>(begin)); rc != SQLITE_OK)
+		throw runtime_error(sqlite3_errstr(rc));
+	slot->data.resize(frames->frame_length(frame, blob_size));
+	decompress_frame(codec, compressed_scratch.data(), compressed_len, slot->data.data(), slot->data.size());
+	slot->frame = frame;
+	slot->last_use = frame_clock;
+	return slot->data;
+}
+
 blob_stream_buf::pos_type blob_stream_buf::seekoff(off_type off, ios_base::seekdir dir, ios_base::openmode which) {
 	if ((which & ios_base::in) != 0 && (which & ios_base::out) != 0)
 		return pos_type(-1);
@@ -584,6 +2694,16 @@ blob_stream_buf::pos_type blob_stream_buf::seekpos(pos_type pos, ios_base::openm
 
 int blob_stream_buf::readFromDevice(char_type* buffer, streamsize length) {
 	if (read_pos >= blob_size || read_pos < 0) return char_traits::eof();
+	if (frames) {
+		const auto frame_size = frames->get_frame_size();
+		const auto pos = static_cast<uint64_t>(static_cast<streamoff>(read_pos));
+		const string& frame = get_frame(static_cast<size_t>(pos / frame_size));
+		const auto in_frame = pos % frame_size;
+		const auto len = min(length, static_cast<streamsize>(frame.size() - in_frame));
+		memcpy(buffer, frame.data() + in_frame, len);
+		read_pos += len;
+		return len;
+	}
 	const auto len = min(length, static_cast<streamsize>(blob_size - read_pos));
 	if (const auto rc = sqlite3_blob_read(blob, buffer, len, read_pos); rc != SQLITE_OK)
 		throw runtime_error(sqlite3_errstr(rc));
@@ -592,6 +2712,7 @@ int blob_stream_buf::readFromDevice(char_type* buffer, streamsize length) {
 }
 
 int blob_stream_buf::writeToDevice(const char_type* buffer, streamsize length) {
+	if (frames) return char_traits::eof();
 	if (write_pos >= blob_size) return char_traits::eof();
 	const auto len = min(length, static_cast<streamsize>(blob_size - write_pos));
 	if (const auto rc = sqlite3_blob_write(blob, buffer, len, write_pos); rc != SQLITE_OK)
@@ -608,6 +2729,10 @@ void blob_ios::open(sqlite3* s, const string_view& db, const string_view& table,
 	_buf.open(s, db, table, column, row, read_write);
 }
 
+void blob_ios::open_compressed(sqlite3* s, const string_view& db, const string_view& table, const string_view& column, const sqlite3_int64 row, PackCodec codec, shared_ptr<const frame_index> frames, uint64_t size) {
+	_buf.open_compressed(s, db, table, column, row, codec, std::move(frames), size);
+}
+
 blob_stream_buf* blob_ios::rdbuf() { return &_buf; }
 
 blob_stream::blob_stream() : blob_ios(false), iostream(&_buf) {}
@@ -632,10 +2757,25 @@ void RegisterScriptPack(asIScriptEngine* engine) {
 	engine->RegisterEnumValue("pack_open_mode", "SQLITE_PACK_OPEN_MODE_SHARED_CACHE", SQLITE_OPEN_SHAREDCACHE);
 	engine->RegisterEnumValue("pack_open_mode", "SQLITE_PACK_OPEN_MODE_PRIVATE_CACHE", SQLITE_OPEN_PRIVATECACHE);
 	engine->RegisterEnumValue("pack_open_mode", "SQLITE_PACK_OPEN_MODE_NO_FOLLOW", SQLITE_OPEN_NOFOLLOW);
+	engine->RegisterEnumValue("pack_open_mode", "SQLITE_PACK_OPEN_MODE_LAZY", PACK_OPEN_LAZY);
 	engine->RegisterEnum("sqlite_pack_find_mode");
 	engine->RegisterEnumValue("sqlite_pack_find_mode", "SQLITE_PACK_FIND_MODE_LIKE", static_cast<underlying_type_t<FindMode>>(FindMode::Like));
 	engine->RegisterEnumValue("sqlite_pack_find_mode", "SQLITE_PACK_FIND_MODE_GLOB", static_cast<underlying_type_t<FindMode>>(FindMode::Glob));
 	engine->RegisterEnumValue("sqlite_pack_find_mode", "SQLITE_PACK_FIND_MODE_REGEXP", static_cast<underlying_type_t<FindMode>>(FindMode::Regexp));
+	engine->RegisterEnum("sqlite_pack_merge_policy");
+	engine->RegisterEnumValue("sqlite_pack_merge_policy", "SQLITE_PACK_MERGE_SKIP", static_cast<underlying_type_t<MergePolicy>>(MergePolicy::Skip));
+	engine->RegisterEnumValue("sqlite_pack_merge_policy", "SQLITE_PACK_MERGE_REPLACE", static_cast<underlying_type_t<MergePolicy>>(MergePolicy::Replace));
+	engine->RegisterEnumValue("sqlite_pack_merge_policy", "SQLITE_PACK_MERGE_FAIL", static_cast<underlying_type_t<MergePolicy>>(MergePolicy::Fail));
+	engine->RegisterEnum("sqlite_pack_profile");
+	engine->RegisterEnumValue("sqlite_pack_profile", "SQLITE_PACK_PROFILE_DEFAULT", static_cast<underlying_type_t<PackProfile>>(PackProfile::Default));
+	engine->RegisterEnumValue("sqlite_pack_profile", "SQLITE_PACK_PROFILE_STREAMING", static_cast<underlying_type_t<PackProfile>>(PackProfile::Streaming));
+	engine->RegisterEnumValue("sqlite_pack_profile", "SQLITE_PACK_PROFILE_RANDOM_SMALL", static_cast<underlying_type_t<PackProfile>>(PackProfile::RandomSmall));
+	engine->RegisterEnumValue("sqlite_pack_profile", "SQLITE_PACK_PROFILE_BULK_BUILD", static_cast<underlying_type_t<PackProfile>>(PackProfile::BulkBuild));
+	engine->RegisterEnum("sqlite_pack_codec");
+	engine->RegisterEnumValue("sqlite_pack_codec", "SQLITE_PACK_CODEC_NONE", static_cast<underlying_type_t<PackCodec>>(PackCodec::None));
+	engine->RegisterEnumValue("sqlite_pack_codec", "SQLITE_PACK_CODEC_DEFLATE", static_cast<underlying_type_t<PackCodec>>(PackCodec::Deflate));
+	engine->RegisterEnumValue("sqlite_pack_codec", "SQLITE_PACK_CODEC_LZ", static_cast<underlying_type_t<PackCodec>>(PackCodec::Lz));
+	engine->RegisterFuncdef("void sqlite_pack_progress_callback(const string&in file_name, uint64 done, uint64 total)");
 	engine->RegisterObjectType("sqlite_pack", 0, asOBJ_REF);
 	engine->RegisterObjectBehaviour("sqlite_pack", asBEHAVE_FACTORY, "sqlite_pack @p()", asFUNCTION(ScriptPack_Factory), asCALL_CDECL);
 	engine->RegisterObjectBehaviour("sqlite_pack", asBEHAVE_ADDREF, "void f()", asMETHOD(pack, duplicate), asCALL_THISCALL);
@@ -644,7 +2784,8 @@ void RegisterScriptPack(asIScriptEngine* engine) {
 	engine->RegisterObjectMethod("sqlite_pack", "bool rekey(const string& key)", asMETHOD(pack, rekey), asCALL_THISCALL);
 	engine->RegisterObjectMethod("sqlite_pack", "bool close()", asMETHOD(pack, close), asCALL_THISCALL);
 	engine->RegisterObjectMethod("sqlite_pack", "bool add_file(const string &in disc_filename, const string& in pack_filename, bool allow_replace = false)", asMETHOD(pack, add_file), asCALL_THISCALL);
-	engine->RegisterObjectMethod("sqlite_pack", "bool add_directory(const string &in dir, const bool allow_replace = false)", asMETHOD(pack, add_directory), asCALL_THISCALL);
+	engine->RegisterObjectMethod("sqlite_pack", "bool add_directory(const string &in dir, const bool allow_replace = false, const uint thread_count = 0, sqlite_pack_progress_callback@ progress = null)", asMETHOD(pack, add_directory_script), asCALL_THISCALL);
+	engine->RegisterObjectMethod("sqlite_pack", "dictionary@ sync_directory(const string &in dir, const uint thread_count = 0, sqlite_pack_progress_callback@ progress = null)", asMETHOD(pack, sync_directory_script), asCALL_THISCALL);
 	engine->RegisterObjectMethod("sqlite_pack", "bool add_memory(const string &in pack_filename, const string& in data, bool allow_replace = false)", asMETHODPR(pack, add_memory, (const string&, const string&, bool), bool), asCALL_THISCALL);
 	engine->RegisterObjectMethod("sqlite_pack", "bool delete_file(const string &in pack_filename)", asMETHOD(pack, delete_file), asCALL_THISCALL);
 	engine->RegisterObjectMethod("sqlite_pack", "bool file_exists(const string &in pack_filename) const", asMETHOD(pack, file_exists), asCALL_THISCALL);
@@ -652,14 +2793,36 @@ void RegisterScriptPack(asIScriptEngine* engine) {
 	engine->RegisterObjectMethod("sqlite_pack", "string[]@ list_files() const", asMETHODPR(pack, list_files, (), CScriptArray*), asCALL_THISCALL);
 	engine->RegisterObjectMethod("sqlite_pack", "uint get_file_size(const string &in pack_filename) const", asMETHOD(pack, get_file_size), asCALL_THISCALL);
 	engine->RegisterObjectMethod("sqlite_pack", "string read_file(const string &in pack_filename, uint offset_in_file, uint read_byte_count) const", asMETHOD(pack, read_file_string), asCALL_THISCALL);
+	engine->RegisterObjectMethod("sqlite_pack", "void prefetch(const string[]@ names, int priority = 0)", asMETHODPR(pack, prefetch, (CScriptArray*, int), void), asCALL_THISCALL);
+	engine->RegisterObjectMethod("sqlite_pack", "string[]@ poll_prefetch()", asMETHODPR(pack, poll_prefetch, (), CScriptArray*), asCALL_THISCALL);
+	engine->RegisterObjectMethod("sqlite_pack", "void cancel_prefetch()", asMETHOD(pack, cancel_prefetch), asCALL_THISCALL);
+	engine->RegisterObjectMethod("sqlite_pack", "uint64 get_prefetch_pending() const property", asMETHOD(pack, get_prefetch_pending), asCALL_THISCALL);
+	engine->RegisterObjectMethod("sqlite_pack", "uint64 get_prefetch_cache_limit() const property", asMETHOD(pack, get_prefetch_cache_limit), asCALL_THISCALL);
+	engine->RegisterObjectMethod("sqlite_pack", "void set_prefetch_cache_limit(uint64 limit) property", asMETHOD(pack, set_prefetch_cache_limit), asCALL_THISCALL);
+	engine->RegisterObjectMethod("sqlite_pack", "uint get_prefetch_threads() const property", asMETHOD(pack, get_prefetch_threads), asCALL_THISCALL);
+	engine->RegisterObjectMethod("sqlite_pack", "void set_prefetch_threads(uint threads) property", asMETHOD(pack, set_prefetch_threads), asCALL_THISCALL);
+	engine->RegisterObjectMethod("sqlite_pack", "uint64 get_file_cache_limit() const property", asMETHOD(pack, get_file_cache_limit), asCALL_THISCALL);
+	engine->RegisterObjectMethod("sqlite_pack", "void set_file_cache_limit(uint64 limit) property", asMETHOD(pack, set_file_cache_limit), asCALL_THISCALL);
+	engine->RegisterObjectMethod("sqlite_pack", "uint64 get_file_cache_bytes() const property", asMETHOD(pack, get_file_cache_bytes), asCALL_THISCALL);
+	engine->RegisterObjectMethod("sqlite_pack", "uint64 get_file_cache_hits() const property", asMETHOD(pack, get_file_cache_hits), asCALL_THISCALL);
+	engine->RegisterObjectMethod("sqlite_pack", "uint64 get_file_cache_misses() const property", asMETHOD(pack, get_file_cache_misses), asCALL_THISCALL);
+	engine->RegisterObjectMethod("sqlite_pack", "uint64 get_file_cache_evictions() const property", asMETHOD(pack, get_file_cache_evictions), asCALL_THISCALL);
+	engine->RegisterObjectMethod("sqlite_pack", "dictionary@ read_files(const string[]@ names) const", asMETHODPR(pack, read_files, (CScriptArray*) const, CScriptDictionary*), asCALL_THISCALL);
 	engine->RegisterObjectMethod("sqlite_pack", "bool get_active() const property", asMETHOD(pack, get_is_active), asCALL_THISCALL);
 	engine->RegisterObjectMethod("sqlite_pack", "uint get_size() const property", asMETHOD(pack, size), asCALL_THISCALL);
 	engine->RegisterObjectMethod("sqlite_pack", "datastream@ get_file(const string&in file_name, const bool rw = false)", asMETHODPR(pack, open_file, (const string&, const bool), void*), asCALL_THISCALL);
 	engine->RegisterObjectMethod("sqlite_pack", "void allocate_file(const string& file_name, const int64 size, const bool allow_replace = false)", asMETHODPR(pack, allocate_file, (const string&, const int64_t, const bool), void), asCALL_THISCALL);
 	engine->RegisterObjectMethod("sqlite_pack", "bool rename_file(const string& old, const string& new_)", asMETHOD(pack, rename_file), asCALL_THISCALL);
+	engine->RegisterObjectMethod("sqlite_pack", "int64 merge_from(const string&in filename, const string&in key = \"\", sqlite_pack_merge_policy policy = SQLITE_PACK_MERGE_SKIP)", asMETHOD(pack, merge_from), asCALL_THISCALL);
 	engine->RegisterObjectMethod("sqlite_pack", "void clear()", asMETHOD(pack, clear), asCALL_THISCALL);
+	engine->RegisterObjectMethod("sqlite_pack", "bool get_trace_access() const property", asMETHOD(pack, get_trace_access), asCALL_THISCALL);
+	engine->RegisterObjectMethod("sqlite_pack", "void set_trace_access(bool enabled) property", asMETHOD(pack, set_trace_access), asCALL_THISCALL);
+	engine->RegisterObjectMethod("sqlite_pack", "array<string>@ get_access_log() const", asMETHODPR(pack, get_access_log, () const, CScriptArray*), asCALL_THISCALL);
+	engine->RegisterObjectMethod("sqlite_pack", "void clear_access_log()", asMETHOD(pack, clear_access_log), asCALL_THISCALL);
+	engine->RegisterObjectMethod("sqlite_pack", "void optimize(const array<string>@ access_order = null)", asMETHOD(pack, optimize_script), asCALL_THISCALL);
 	engine->RegisterObjectMethod("sqlite_pack", "sqlite3statement@ prepare(const string& statement, const bool persistant = false)", asMETHOD(pack, prepare), asCALL_THISCALL);
-	engine->RegisterObjectMethod("sqlite_pack", "string[]@ find(const string& what, const sqlite_pack_find_mode mode = SQLITE_PACK_FIND_MODE_LIKE)", asMETHOD(pack, find), asCALL_THISCALL);
+	engine->RegisterObjectMethod("sqlite_pack", "string[]@ find(const string& what, const sqlite_pack_find_mode mode = SQLITE_PACK_FIND_MODE_LIKE)", asMETHODPR(pack, find, (const string&, const FindMode), CScriptArray*), asCALL_THISCALL);
+	engine->RegisterObjectMethod("sqlite_pack", "string[]@ list_directory(const string&in dir, const bool recursive = true) const", asMETHODPR(pack, list_directory, (const string&, const bool) const, CScriptArray*), asCALL_THISCALL);
 	engine->RegisterObjectMethod("sqlite_pack", "dictionary@[]@ exec(const string& sql)", asMETHOD(pack, exec), asCALL_THISCALL);
 	engine->RegisterObjectMethod("sqlite_pack", "pack_interface@ opImplCast()", asFUNCTION((pack_interface::op_cast<pack, pack_interface>)), asCALL_CDECL_OBJFIRST);
 	engine->RegisterObjectMethod("pack_interface", "sqlite_pack@ opCast()", asFUNCTION((pack_interface::op_cast<pack_interface, pack>)), asCALL_CDECL_OBJFIRST);
@@ -667,5 +2830,35 @@ void RegisterScriptPack(asIScriptEngine* engine) {
 	engine->RegisterObjectMethod("sqlite_pack", "bool open(const string &in filename, const string &in key = \"\", const bool rw = false)", asMETHODPR(pack, open, (const string&, const string&, bool), bool), asCALL_THISCALL);
 	engine->RegisterObjectMethod("sqlite_pack", "bool add_stream(const string &in internal_name, datastream@ ds, const bool allow_replace=false)", asMETHOD(pack, add_stream), asCALL_THISCALL);
 	engine->RegisterObjectMethod("sqlite_pack", "int64 get_file_count() const property", asMETHOD(pack, get_file_count), asCALL_THISCALL);
+	engine->RegisterObjectMethod("sqlite_pack", "bool get_entry_cache_ready() const property", asMETHOD(pack, get_entry_cache_ready), asCALL_THISCALL);
+	engine->RegisterObjectMethod("sqlite_pack", "uint64 get_entry_cache_memory() const property", asMETHOD(pack, get_entry_cache_memory), asCALL_THISCALL);
+	engine->RegisterObjectMethod("sqlite_pack", "uint64 get_entry_cache_name_bytes() const property", asMETHOD(pack, get_entry_cache_name_bytes), asCALL_THISCALL);
 	engine->RegisterObjectMethod("sqlite_pack", "bool extract_file(const string &in internal_name, const string &in file_on_disk)", asMETHOD(pack, extract_file), asCALL_THISCALL);
+	engine->RegisterObjectMethod("sqlite_pack", "uint64 extract_all(const string &in dest_dir, const string &in pattern = \"%\", const uint thread_count = 0, sqlite_pack_progress_callback@ progress = null)", asMETHOD(pack, extract_all_script), asCALL_THISCALL);
+	engine->RegisterObjectMethod("sqlite_pack", "datastream@ map_file(const string&in file_name)", asMETHOD(pack, map_file_script), asCALL_THISCALL);
+	engine->RegisterObjectMethod("sqlite_pack", "uint64 get_mapped_view_limit() const property", asMETHOD(pack, get_mapped_view_limit), asCALL_THISCALL);
+	engine->RegisterObjectMethod("sqlite_pack", "void set_mapped_view_limit(uint64 limit) property", asMETHOD(pack, set_mapped_view_limit), asCALL_THISCALL);
+	engine->RegisterObjectMethod("sqlite_pack", "sqlite_pack_codec get_compression() const property", asMETHOD(pack, get_compression), asCALL_THISCALL);
+	engine->RegisterObjectMethod("sqlite_pack", "void set_compression(sqlite_pack_codec codec) property", asMETHOD(pack, set_compression), asCALL_THISCALL);
+	engine->RegisterObjectMethod("sqlite_pack", "int get_compression_level() const property", asMETHOD(pack, get_compression_level), asCALL_THISCALL);
+	engine->RegisterObjectMethod("sqlite_pack", "void set_compression_level(int level) property", asMETHOD(pack, set_compression_level), asCALL_THISCALL);
+	engine->RegisterObjectMethod("sqlite_pack", "uint get_compression_frame_size() const property", asMETHOD(pack, get_compression_frame_size), asCALL_THISCALL);
+	engine->RegisterObjectMethod("sqlite_pack", "void set_compression_frame_size(uint size) property", asMETHOD(pack, set_compression_frame_size), asCALL_THISCALL);
+	engine->RegisterObjectMethod("sqlite_pack", "sqlite_pack_codec get_file_codec(const string&in pack_filename) const", asMETHOD(pack, get_file_codec), asCALL_THISCALL);
+	engine->RegisterObjectMethod("sqlite_pack", "uint64 get_statement_cache_hits() const property", asMETHOD(pack, get_statement_cache_hits), asCALL_THISCALL);
+	engine->RegisterObjectMethod("sqlite_pack", "uint64 get_statement_cache_misses() const property", asMETHOD(pack, get_statement_cache_misses), asCALL_THISCALL);
+	engine->RegisterObjectMethod("sqlite_pack", "bool get_deduplicate() const property", asMETHOD(pack, get_deduplicate), asCALL_THISCALL);
+	engine->RegisterObjectMethod("sqlite_pack", "void set_deduplicate(bool enabled) property", asMETHOD(pack, set_deduplicate), asCALL_THISCALL);
+	engine->RegisterObjectMethod("sqlite_pack", "sqlite_pack_profile get_profile() const property", asMETHOD(pack, get_profile), asCALL_THISCALL);
+	engine->RegisterObjectMethod("sqlite_pack", "void set_profile(sqlite_pack_profile profile) property", asMETHOD(pack, set_profile), asCALL_THISCALL);
+	engine->RegisterObjectMethod("sqlite_pack", "uint get_import_buffer_size() const property", asMETHOD(pack, get_import_buffer_size), asCALL_THISCALL);
+	engine->RegisterObjectMethod("sqlite_pack", "void set_import_buffer_size(uint size) property", asMETHOD(pack, set_import_buffer_size), asCALL_THISCALL);
+	engine->RegisterObjectMethod("sqlite_pack", "bool get_map_imports() const property", asMETHOD(pack, get_map_imports), asCALL_THISCALL);
+	engine->RegisterObjectMethod("sqlite_pack", "void set_map_imports(bool enabled) property", asMETHOD(pack, set_map_imports), asCALL_THISCALL);
+	engine->RegisterObjectMethod("sqlite_pack", "uint64 get_blob_opens() const property", asMETHOD(pack, get_blob_opens), asCALL_THISCALL);
+	engine->RegisterObjectMethod("sqlite_pack", "uint64 get_blob_reopens() const property", asMETHOD(pack, get_blob_reopens), asCALL_THISCALL);
+	engine->RegisterObjectMethod("sqlite_pack", "uint64 get_blob_reuses() const property", asMETHOD(pack, get_blob_reuses), asCALL_THISCALL);
+	engine->RegisterObjectMethod("sqlite_pack", "uint get_read_pool_size() const property", asMETHOD(pack, get_read_pool_size), asCALL_THISCALL);
+	engine->RegisterObjectMethod("sqlite_pack", "void set_read_pool_size(uint size) property", asMETHOD(pack, set_read_pool_size), asCALL_THISCALL);
+	engine->RegisterObjectMethod("sqlite_pack", "uint64 get_read_pool_opens() const property", asMETHOD(pack, get_read_pool_opens), asCALL_THISCALL);
 }
@@ -15,6 +15,7 @@
 #include "sqlite3.h"
 #include <cstdint>
 #include <unordered_map>
+#include <unordered_set>
 #include <Poco/RefCountedObject.h>
 #include <scriptarray.h>
 #include <scriptdictionary.h>
@@ -24,7 +25,20 @@
 #include <iostream>
 #include <ios>
 #include "nvgt_sqlite.h"
+#include "pack_codec.h"
 #include <memory>
+#include <span>
+#include <functional>
+#include <future>
+#include <optional>
+#include <Poco/AutoPtr.h>
+#include <Poco/MemoryStream.h>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <thread>
+#include <queue>
+#include <list>
 
 enum class FindMode {
 	Like,
@@ -32,13 +46,202 @@ enum class FindMode {
 	Regexp
 };
 
+// What merge_from does with an entry whose name already exists in the destination.
+enum class MergePolicy {
+	Skip,
+	Replace,
+	Fail
+};
+
+// Pragma sets tuned for a workload, applied when a pack is opened. See get_profile_settings in pack.cpp.
+enum class PackProfile {
+	Default,
+	Streaming, // Large entries read start to finish, such as music.
+	RandomSmall, // Many small entries read in no particular order.
+	BulkBuild // Writing a whole pack at once. Takes an exclusive lock and skips syncing until close.
+};
+
 struct pack_entry {
-	std::string name;
-	uint64_t size;
+	std::string_view name; // Points into the owning entry_table's arena.
+	uint64_t size; // Uncompressed size.
 	int64_t rowid;
+	PackCodec codec = PackCodec::None;
+	int64_t content = 0; // The pack_content row holding the bytes of a deduplicated entry, or 0 when they live in pack_files.
+	const char* data_table() const { return content ? "pack_content" : "pack_files"; }
+	int64_t data_rowid() const { return content ? content : rowid; }
+	// Identifies the stored bytes across both tables: positive for pack_files rows and negative for pack_content rows, so entries sharing content share cached frames and payloads.
+	int64_t data_key() const { return content ? -content : rowid; }
 };
 
 class blob_stream;
+struct directory_item;
+
+// The in-memory list of entries in a pack, indexed by name, by rowid and in sorted name order.
+// Names are interned back to back in large arena blocks and entries sit in one flat vector, with two open-addressing tables of record indexes on top, so a pack of a few hundred thousand files costs a handful of allocations instead of several per entry. Erased records are left as holes until the next rebuild compacts them. Pointers returned by find are invalidated by put.
+class entry_table {
+	std::vector<std::unique_ptr<char[]>> arena;
+	std::size_t arena_block_used = 0, arena_block_size = 0;
+	std::uint64_t arena_bytes = 0, name_bytes = 0;
+	std::vector<pack_entry> records; // Erased records have a null name.
+	std::size_t live = 0;
+	// Slots hold a record index plus one; 0 is empty and UINT32_MAX a tombstone.
+	std::vector<std::uint32_t> name_slots, rowid_slots;
+	mutable std::vector<std::string_view> sorted;
+	mutable bool sorted_dirty = false;
+	std::string_view intern(std::string_view name);
+	std::size_t find_name_slot(std::string_view name) const;
+	std::size_t find_rowid_slot(std::int64_t rowid, std::uint32_t index) const;
+	void link(std::uint32_t index);
+	void rebuild(std::size_t capacity);
+public:
+	const pack_entry* find(std::string_view name) const;
+	const pack_entry* find_rowid(std::int64_t rowid) const;
+	// Adds a record for a name that isn't in the table yet.
+	void put(const pack_entry& entry);
+	void erase(std::string_view name);
+	void clear();
+	std::size_t size() const { return live; }
+	std::uint64_t total_size() const;
+	const std::vector<std::string_view>& sorted_names() const;
+	// Bytes held by the table, and how many of those are live name bytes.
+	std::uint64_t memory_usage() const;
+	std::uint64_t get_name_bytes() const { return name_bytes; }
+};
+
+// Or'ed into the open mode to make the entry cache load in the background instead of before open returns.
+constexpr int PACK_OPEN_LAZY = 0x40000000;
+
+// A read-only view of one entry's bytes, backed by a stepped statement rather than a blob handle. When the payload lives on its b-tree page and the pack is memory mapped, sqlite3_column_blob returns a pointer straight into the mapping; SQLite only assembles a private copy when the payload spills onto overflow pages. The pointer stays valid for the lifetime of the view, which also holds a read transaction open, so keep views on writable packs short-lived.
+class pack_view : public Poco::RefCountedObject {
+	std::shared_ptr<sqlite3> connection; // Set when the view reads through a pooled connection, which it keeps until destroyed.
+	sqlite3_stmt* stmt;
+	const unsigned char* ptr;
+	std::uint64_t len;
+public:
+	pack_view(sqlite3* db, const pack_entry& entry);
+	pack_view(std::shared_ptr<sqlite3> pooled, const pack_entry& entry);
+	~pack_view();
+	const unsigned char* data() const { return ptr; }
+	std::uint64_t size() const { return len; }
+	std::span<const unsigned char> span() const { return {ptr, static_cast<std::size_t>(len)}; }
+};
+
+class pack_view_holder {
+protected:
+	Poco::AutoPtr<pack_view> view;
+	pack_view_holder(pack_view* v) : view(v) {}
+};
+
+// An istream reading directly from a pack_view, keeping the view alive for as long as the stream exists.
+class pack_view_stream : private pack_view_holder, public Poco::MemoryInputStream {
+public:
+	pack_view_stream(pack_view* v);
+	pack_view* get_view() const { return view.get(); }
+};
+
+class shared_payload_holder {
+protected:
+	std::shared_ptr<const std::string> payload;
+	shared_payload_holder(std::shared_ptr<const std::string> p) : payload(std::move(p)) {}
+};
+
+// An istream over a decoded payload shared with a cache, keeping the payload alive for as long as the stream exists.
+class shared_payload_stream : private shared_payload_holder, public Poco::MemoryInputStream {
+public:
+	shared_payload_stream(std::shared_ptr<const std::string> p);
+};
+
+// Reads entries ahead of time on worker threads, each with its own read-only connection to the pack's file, and holds the decoded payloads for the pack to serve reads from. Payloads that would exceed the byte limit are read and dropped, which still leaves them in the OS page cache. Like entry_lru, payloads are keyed by data_key and tagged with the writer's data version when the job was queued, so nothing read before a later commit is served after it.
+class pack_prefetcher {
+public:
+	struct job {
+		std::string name;
+		std::int64_t rowid;
+		std::uint64_t size;
+		PackCodec codec;
+		std::int64_t content;
+		int priority;
+		std::uint64_t sequence;
+		unsigned int version;
+		std::int64_t data_key() const { return content ? -content : rowid; }
+	};
+	pack_prefetcher(const std::string& filename, const std::string& key, unsigned int thread_count, std::uint64_t byte_limit);
+	~pack_prefetcher();
+	void enqueue(std::vector<job>&& jobs);
+	// Misses unless the payload was queued at the given data version.
+	std::shared_ptr<const std::string> find(std::int64_t data_key, unsigned int version) const;
+	// Moves the names loaded since the last call into names.
+	void take_completed(std::vector<std::string>& names);
+	std::size_t pending() const;
+	void set_byte_limit(std::uint64_t limit);
+	// Drops queued jobs and loaded payloads. Jobs already running finish but their results are discarded.
+	void clear();
+private:
+	struct job_order {
+		bool operator()(const job& a, const job& b) const { return a.priority != b.priority ? a.priority < b.priority : a.sequence > b.sequence; }
+	};
+	void run(const std::string& filename, const std::string& key);
+	mutable std::mutex mutex;
+	std::condition_variable wake;
+	std::priority_queue<job, std::vector<job>, job_order> queue;
+	struct loaded_payload {
+		unsigned int version;
+		std::shared_ptr<const std::string> data;
+	};
+	std::unordered_map<std::int64_t, loaded_payload> loaded;
+	std::vector<std::string> completed;
+	std::uint64_t loaded_bytes = 0, byte_limit, next_sequence = 0, generation = 0;
+	std::size_t in_flight = 0;
+	bool stopping = false;
+	std::vector<std::thread> workers;
+};
+
+// A byte-budgeted LRU of whole decoded entries keyed by rowid and tagged with the data version they were read at. One instance is shared by a pack and every immutable copy made from it, so it locks internally. Entries over an eighth of the budget are never cached, so one large file can't flush everything else.
+class entry_lru {
+	struct node {
+		std::int64_t rowid;
+		unsigned int version;
+		std::shared_ptr<const std::string> data;
+	};
+	mutable std::mutex mutex;
+	std::list<node> order; // Most recently used first.
+	std::unordered_map<std::int64_t, std::list<node>::iterator> index;
+	std::uint64_t bytes = 0, limit, generation = 0;
+	std::uint64_t hits = 0, misses = 0, evictions = 0;
+	void evict_to(std::uint64_t target);
+public:
+	explicit entry_lru(std::uint64_t byte_limit) : limit(byte_limit) {}
+	bool accepts(std::uint64_t size) const;
+	// Misses unless the entry was stored at the given data version.
+	std::shared_ptr<const std::string> get(std::int64_t rowid, unsigned int version);
+	// Stores data read at version while get_generation() returned generation; it is dropped if the cache was cleared since, as it may be stale.
+	void put(std::int64_t rowid, std::shared_ptr<const std::string> data, std::uint64_t read_generation, unsigned int version);
+	void clear();
+	std::uint64_t get_generation() const;
+	std::uint64_t get_limit() const;
+	void set_limit(std::uint64_t byte_limit);
+	std::uint64_t get_bytes() const;
+	std::uint64_t get_hits() const;
+	std::uint64_t get_misses() const;
+	std::uint64_t get_evictions() const;
+};
+
+// Read-only connections to a pack's file, each lent to one reader at a time so they can be opened without SQLite's mutex while still being safe to hand between threads.
+class pack_read_pool : public std::enable_shared_from_this<pack_read_pool> {
+	std::mutex mutex;
+	std::vector<sqlite3*> idle;
+	std::string filename, key;
+	PackProfile profile;
+	std::size_t max_idle;
+	std::uint64_t opens = 0;
+	void release(sqlite3* db);
+public:
+	pack_read_pool(const std::string& filename, const std::string& key, PackProfile profile, std::size_t max_idle);
+	~pack_read_pool();
+	// The connection returns to the pool when the last copy of the result is released, so the pool outlives every lease.
+	std::shared_ptr<sqlite3> acquire();
+	std::uint64_t get_opens();
+};
 
 class pack : public pack_interface {
 private:
@@ -47,7 +250,17 @@ private:
 	const pack* mutable_origin;
 	std::string pack_name;
 	std::string pack_key;
+	std::uint64_t mapped_view_limit;
+	PackCodec compression;
+	int compression_level;
+	std::uint32_t compression_frame_size;
+	bool has_codec_columns;
+	PackProfile profile;
+	// Checkpoints a bulk built pack durably before its connection closes.
+	void finish_profile();
 public:
+	// Invoked with the entry name, the number of entries processed so far and the total.
+	using progress_callback = std::function<void(const std::string&, std::uint64_t, std::uint64_t)>;
 	pack();
 	pack(const pack& other);
 	~pack();
@@ -57,7 +270,18 @@ public:
 	bool rekey(const std::string& key);
 	bool close();
 	bool add_file(const std::string& disk_filename, const std::string& pack_filename, bool allow_replace = false);
-	bool add_directory(const std::string& dir, bool allow_replace = false);
+	// Reads files on thread_count reader threads (0 for one per core) while the calling thread writes them into a single transaction.
+	bool add_directory(const std::string& dir, bool allow_replace = false, unsigned int thread_count = 0, const progress_callback& progress = nullptr);
+	bool add_directory_script(const std::string& dir, bool allow_replace, unsigned int thread_count, asIScriptFunction* progress);
+	struct sync_summary {
+		std::uint64_t added = 0;
+		std::uint64_t updated = 0;
+		std::uint64_t removed = 0;
+		std::uint64_t skipped = 0;
+	};
+	// Brings the pack in line with dir using the pack_manifest table: files whose size and mtime (or, failing that, content hash) are unchanged are skipped, and entries whose source vanished are deleted.
+	sync_summary sync_directory(const std::string& dir, unsigned int thread_count = 0, const progress_callback& progress = nullptr);
+	CScriptDictionary* sync_directory_script(const std::string& dir, unsigned int thread_count, asIScriptFunction* progress);
 	bool add_memory(const std::string& pack_filename, unsigned char* data, unsigned int size, bool allow_replace = false);
 	bool add_memory(const std::string& pack_filename, const std::string& data, bool allow_replace = false);
 	bool add_stream(const std::string &internal_name, void* ds, const bool allow_replace);
@@ -69,18 +293,57 @@ public:
 	std::uint64_t get_file_size(const std::string& pack_filename);
 	unsigned int read_file(const std::string& pack_filename, unsigned int offset, unsigned char* buffer, unsigned int size);
 	std::string read_file_string(const std::string& pack_filename, unsigned int offset, unsigned int size);
+	// Queues entries to be read and decoded on background threads so that later reads are served from memory. Higher priorities load first. Names that finish loading are reported by poll_prefetch.
+	void prefetch(const std::vector<std::string>& names, int priority = 0);
+	void prefetch(CScriptArray* names, int priority);
+	void poll_prefetch(std::vector<std::string>& names);
+	CScriptArray* poll_prefetch();
+	void cancel_prefetch();
+	std::uint64_t get_prefetch_pending() const;
+	std::uint64_t get_prefetch_cache_limit() const { return prefetch_cache_limit; }
+	void set_prefetch_cache_limit(std::uint64_t limit);
+	unsigned int get_prefetch_threads() const { return prefetch_threads; }
+	void set_prefetch_threads(unsigned int threads);
+	std::uint64_t get_file_cache_limit() const { return file_cache->get_limit(); }
+	void set_file_cache_limit(std::uint64_t limit) { file_cache->set_limit(limit); }
+	std::uint64_t get_file_cache_bytes() const { return file_cache->get_bytes(); }
+	std::uint64_t get_file_cache_hits() const { return file_cache->get_hits(); }
+	std::uint64_t get_file_cache_misses() const { return file_cache->get_misses(); }
+	std::uint64_t get_file_cache_evictions() const { return file_cache->get_evictions(); }
+	// Reads many whole entries in one pass, in rowid order through a single reopened blob handle. Results follow the order of names; missing entries are left empty.
+	std::vector<std::optional<std::string>> read_files(const std::vector<std::string>& names) const;
+	CScriptDictionary* read_files(CScriptArray* names) const;
 	std::uint64_t size();
 	int64_t get_file_count();
+	bool get_entry_cache_ready() const { return entry_cache_ready(); }
+	std::uint64_t get_entry_cache_memory() const;
+	std::uint64_t get_entry_cache_name_bytes() const;
 	bool get_is_active() const override {
 		return db;
 	}
-	blob_stream open_file_stream(const std::string& file_name, const bool rw);
+	std::iostream* open_file_stream(const std::string& file_name, const bool rw);
 	void* open_file(const std::string& file_name, const bool rw);
 	void allocate_file(const std::string& file_name, const std::int64_t size, const bool allow_replace = false);
 	bool rename_file(const std::string& old, const std::string& new_);
+	// Copies every entry of another pack into this one inside SQLite, without passing payloads through memory. Returns the number of entries copied.
+	std::int64_t merge_from(const std::string& filename, const std::string& key, MergePolicy policy);
 	void clear();
+	// While trace_access is set, the pack records the name of each entry the first time it is read.
+	bool get_trace_access() const { return trace_access; }
+	void set_trace_access(bool enabled) { trace_access = enabled; }
+	void get_access_log(std::vector<std::string>& names) const;
+	CScriptArray* get_access_log() const;
+	void clear_access_log();
+	// Rebuilds the pack with entries stored in the given order, typically an access log, followed by the rest with small entries grouped, then vacuums it so they lie sequentially on disk.
+	void optimize(const std::vector<std::string>& order);
+	void optimize_script(CScriptArray* order);
 	sqlite3statement* prepare(const std::string& statement, const bool persistant = false);
+	// Served from the in-memory name index; LIKE and GLOB patterns with a literal prefix only scan the matching range.
+	void find(const std::string& what, std::vector<std::string>& files, const FindMode mode = FindMode::Like) const;
 	CScriptArray* find(const std::string& what, const FindMode mode = FindMode::Like);
+	// Lists the entries below dir in name order. Without recursion, deeper entries are reported once as their immediate subdirectory with a trailing slash.
+	void list_directory(const std::string& dir, std::vector<std::string>& files, const bool recursive = true) const;
+	CScriptArray* list_directory(const std::string& dir, const bool recursive = true) const;
 	CScriptArray* exec(const std::string& sql);
 	std::istream* get_file(const std::string& filename) const override;
 	sqlite3* get_db_ptr() const;
@@ -89,12 +352,142 @@ public:
 	const pack_interface* get_mutable() const override;
 	const std::string get_pack_name() const override;
 	bool extract_file(const std::string &internal_name, const std::string &file_on_disk);
+	// Extracts every entry matching the LIKE pattern below dest_dir, creating directories as needed, on thread_count workers (0 for one per core) that each read through their own connection. Returns the number of entries written.
+	std::uint64_t extract_all(const std::string& dest_dir, const std::string& pattern = "%", unsigned int thread_count = 0, const progress_callback& progress = nullptr);
+	std::uint64_t extract_all_script(const std::string& dest_dir, const std::string& pattern, unsigned int thread_count, asIScriptFunction* progress);
+	// Views are only zero-copy for entries small enough to sit on one b-tree page of a memory mapped pack; larger entries are copied in full when the view opens.
+	pack_view* map_file(const std::string& file_name) const;
+	void* map_file_script(const std::string& file_name);
+	// Uncompressed entries up to this size are served by get_file as mapped views instead of streams. 0, the default, never does; a page or so is the useful maximum.
+	std::uint64_t get_mapped_view_limit() const { return mapped_view_limit; }
+	void set_mapped_view_limit(std::uint64_t limit) { mapped_view_limit = limit; }
+	PackCodec get_compression() const { return compression; }
+	void set_compression(PackCodec codec) { compression = codec; }
+	int get_compression_level() const { return compression_level; }
+	void set_compression_level(int level) { compression_level = level; }
+	std::uint32_t get_compression_frame_size() const { return compression_frame_size; }
+	void set_compression_frame_size(std::uint32_t size);
+	PackCodec get_file_codec(const std::string& pack_filename) const;
+	std::uint64_t get_statement_cache_hits() const { return stmt_cache_hits; }
+	std::uint64_t get_statement_cache_misses() const { return stmt_cache_misses; }
+	std::uint64_t get_blob_opens() const { return blob_opens; }
+	std::uint64_t get_blob_reopens() const { return blob_reopens; }
+	std::uint64_t get_blob_reuses() const { return blob_reuses; }
+	// Connections get_file may read through, one per concurrent reader, so that readers on different threads don't serialize on the pack's connection. 0 disables the pool.
+	unsigned int get_read_pool_size() const { return read_pool_size; }
+	void set_read_pool_size(unsigned int size);
+	std::uint64_t get_read_pool_opens() const { return read_pool ? read_pool->get_opens() : 0; }
+	// When set, added entries whose bytes are already in the pack share the stored copy instead of storing another.
+	bool get_deduplicate() const { return deduplicate; }
+	void set_deduplicate(bool enabled) { deduplicate = enabled; }
+	// Set before open for page_size to apply to new packs; the other pragmas also apply to an open pack.
+	PackProfile get_profile() const { return profile; }
+	void set_profile(PackProfile new_profile);
+	// Bytes read per blob write when importing from a stream.
+	std::uint32_t get_import_buffer_size() const { return import_buffer_size; }
+	void set_import_buffer_size(std::uint32_t size);
+	// When set, add_file and add_directory map large source files instead of streaming them.
+	bool get_map_imports() const { return map_imports; }
+	void set_map_imports(bool enabled) { map_imports = enabled; }
 	void set_key(const std::string& key);
 	std::string get_key() const;
 private:
 	int64_t get_rowid(const std::string& filename) const;
+	const pack_entry* find_entry(const std::string& filename) const;
+	// A copy of the entry named filename, with its name pointing at filename, for get_file, which may run on any thread. Unlike find_entry it leaves the statement cache and pending_entries alone.
+	std::optional<pack_entry> lookup_entry(const std::string& filename) const;
 	void load_entry_cache() const;
-	mutable std::unordered_map<std::string, pack_entry> entry_cache;
+	// Inserts an entry as given and records it in the entry cache.
+	void insert_entry(const std::string& name, const void* data, std::uint64_t size);
+	void insert_entry(const std::string& name, std::istream& src, std::uint64_t size);
+	void insert_entry(const std::string& name, std::uint64_t size, const compressed_entry& entry);
+	// Inserts an entry, compressing it first if the pack's compression settings ask for it and it pays off.
+	void store_entry(const std::string& name, const void* data, std::uint64_t size);
+	void store_entry(const std::string& name, std::istream& src, std::uint64_t size);
+	// Runs the add_directory reader/writer pipeline inside the caller's transaction, calling written after each entry is stored. hash_all fills in every item's content hash.
+	bool write_directory_items(std::vector<directory_item>& files, bool allow_replace, unsigned int thread_count, bool hash_all, const progress_callback& progress, const std::function<void(const directory_item&)>& written);
+	// Deduplicated storage. Entries are pack_files rows referencing a pack_content row, whose refs column triggers keep in step.
+	void insert_deduplicated(const std::string& name, std::uint64_t hash, std::uint64_t size, const void* data, const compressed_entry* compressed);
+	std::int64_t insert_content(std::uint64_t hash, const void* data, std::uint64_t size);
+	std::int64_t insert_content(std::uint64_t hash, std::istream& src, std::uint64_t size);
+	std::int64_t insert_content(std::uint64_t hash, std::uint64_t size, const compressed_entry& entry);
+	void link_entry(const std::string& name, const pack_entry& content);
+	// Returns the stored content with this hash and size that same confirms, or an entry with content 0.
+	pack_entry find_content(std::uint64_t hash, std::uint64_t size, const std::function<bool(const pack_entry&)>& same) const;
+	bool content_equals(const pack_entry& content, const void* data) const;
+	bool content_equals(const pack_entry& content, std::istream& src) const;
+	bool content_equals(const pack_entry& content, const compressed_entry& compressed) const;
+	bool deduplicate;
+	// Stores a file from disk, mapping it when map_imports allows. try_compress applies the pack's compression settings. Returns false if the file can't be read.
+	bool store_file(const std::string& name, const std::string& disk_path, std::uint64_t size, bool try_compress);
+	std::uint32_t import_buffer_size;
+	bool map_imports;
+	std::shared_ptr<const frame_index> get_frame_index(const pack_entry& entry) const;
+	// Reads size bytes at offset of the entry, decoding compressed entries.
+	void read_entry(const pack_entry& entry, std::uint64_t offset, void* buffer, std::uint64_t size) const;
+	void read_entry(sqlite3_blob* blob, const pack_entry& entry, std::uint64_t offset, void* buffer, std::uint64_t size) const;
+	void read_entry_direct(const pack_entry& entry, std::uint64_t offset, void* buffer, std::uint64_t size) const;
+	mutable std::unordered_map<std::int64_t, std::shared_ptr<const frame_index>> frame_index_cache;
+	// A few read blob handles kept open between calls and moved between rows with sqlite3_blob_reopen. An open handle holds a read transaction, so the pool is emptied before every write, whenever the connection's data version moves and on close.
+	struct pooled_blob {
+		sqlite3_blob* blob;
+		std::int64_t key; // The data_key of the row it's on; reopen can only move a handle within its table.
+		std::uint64_t last_use;
+	};
+	sqlite3_blob* acquire_blob(const pack_entry& entry) const;
+	void release_blob_pool() const;
+	// Called at the top of every mutating method.
+	void begin_write();
+	mutable std::vector<pooled_blob> blob_pool;
+	mutable unsigned int blob_pool_version = 0;
+	// Returns the whole decoded entry from the prefetcher or the file cache, loading it into the latter if it fits. Returns null for entries read straight from SQLite.
+	// When connection is given, reads through it with a one-off reader rather than the blob pool, which only the script's thread may touch.
+	std::shared_ptr<const std::string> find_decoded(const pack_entry& entry, sqlite3* connection = nullptr) const;
+	// The connection of the pack immutable copies descend from, whose data version keys file_cache.
+	sqlite3* cache_version_connection() const;
+	// get_file's reading path, which uses neither the blob pool nor the statement and frame index caches so that it is safe on any thread. Reads through pooled when given, otherwise through the pack's own connection.
+	std::istream* open_entry_stream(const pack_entry& entry, std::shared_ptr<sqlite3> pooled) const;
+	void start_read_pool();
+	unsigned int read_pool_size;
+	void note_access(const std::string& name) const;
+	bool trace_access;
+	mutable std::mutex access_mutex;
+	mutable std::vector<std::string> access_log;
+	mutable std::unordered_set<std::string> access_seen;
+	// Replaced only on the script's thread and under read_pool_mutex, which get_file takes to copy it.
+	std::shared_ptr<pack_read_pool> read_pool;
+	mutable std::mutex read_pool_mutex;
+	void replace_read_pool(std::shared_ptr<pack_read_pool> replacement);
+	std::shared_ptr<entry_lru> file_cache;
+	// Shared with immutable copies and bumped when optimize renumbers rowids; find_entry reloads when it moves.
+	std::shared_ptr<std::atomic<std::uint64_t>> rowid_epoch;
+	mutable std::uint64_t loaded_rowid_epoch;
+	// Only the script's thread replaces the prefetcher, under prefetcher_mutex, so that find_decoded on other threads can take a reference that keeps it alive.
+	std::shared_ptr<pack_prefetcher> prefetcher;
+	mutable std::mutex prefetcher_mutex;
+	std::shared_ptr<pack_prefetcher> current_prefetcher() const;
+	void replace_prefetcher(std::shared_ptr<pack_prefetcher> replacement);
+	std::uint64_t prefetch_cache_limit;
+	unsigned int prefetch_threads;
+	mutable std::uint64_t blob_clock, blob_opens, blob_reopens, blob_reuses;
+	// Returns a persistent statement for sql, preparing it on first use. sql must be a string literal, as its address keys the cache. Callers must reset the statement when done, usually with a stmt_guard.
+	sqlite3_stmt* cached_stmt(const char* sql) const;
+	void finalize_stmt_cache() const;
+	mutable std::unordered_map<const char*, sqlite3_stmt*> stmt_cache;
+	mutable std::uint64_t stmt_cache_hits, stmt_cache_misses;
+	mutable entry_table entry_cache;
+	void cache_put(const pack_entry& entry) const;
+	void cache_erase(const std::string& name) const;
+	void cache_clear() const;
+	void sync_rowid_epoch() const;
+	// Lazily opened packs load their entry cache on a background connection. Until it lands, lookups by name go to SQLite and are remembered in pending_entries; anything needing the whole list waits for it. entry_mutex guards the entry cache and pending_entries, which get_file reads from other threads; only the script's thread changes them.
+	bool entry_cache_ready() const;
+	void ensure_entry_cache() const;
+	void adopt_lazy_entry_cache() const;
+	bool start_lazy_entry_cache(const std::string& key);
+	mutable std::future<entry_table> lazy_load;
+	mutable std::unordered_map<std::string, pack_entry> pending_entries;
+	mutable std::recursive_mutex entry_mutex;
 };
 
 class blob_stream_buf: public Poco::BufferedBidirectionalStreamBuf {
@@ -103,6 +496,8 @@ public:
 	blob_stream_buf(bool read_write = false);
 	~blob_stream_buf();
 	void open(sqlite3* s, const std::string_view& db, const std::string_view& table, const std::string_view& column, const sqlite3_int64 row, const bool read_write);
+	// Opens a compressed entry read-only. Seeks are free; reads decode only the frame they land in, keeping the most recently decoded frames around.
+	void open_compressed(sqlite3* s, const std::string_view& db, const std::string_view& table, const std::string_view& column, const sqlite3_int64 row, PackCodec codec, std::shared_ptr<const frame_index> frames, std::uint64_t size);
 protected:
 	pos_type seekoff( off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which = std::ios_base::in | std::ios_base::out ) override;
 	pos_type seekpos(pos_type pos, std::ios_base::openmode which = std::ios_base::in | std::ios_base::out ) override;
@@ -110,14 +505,29 @@ private:
 	pos_type read_pos, write_pos;
 	int readFromDevice(char_type* buffer, std::streamsize length) override;
 	int writeToDevice(const char_type* buffer, std::streamsize length) override;
+	const std::string& get_frame(std::size_t frame);
 	sqlite3_blob* blob;
-	int blob_size;
+	std::int64_t blob_size; // The uncompressed size for compressed entries.
+	PackCodec codec;
+	std::shared_ptr<const frame_index> frames;
+	struct decoded_frame {
+		std::size_t frame;
+		std::uint64_t last_use;
+		std::string data;
+	};
+	std::vector<decoded_frame> frame_lru;
+	std::string compressed_scratch;
+	std::uint64_t frame_clock;
+	std::shared_ptr<sqlite3> connection; // A pooled connection the blob was opened on. Declared last so it is released after the blob closes.
+public:
+	void keep_connection(std::shared_ptr<sqlite3> pooled) { connection = std::move(pooled); }
 };
 
 class blob_ios: public virtual std::ios {
 public:
 	blob_ios(bool read_write = false);
 	void open(sqlite3* s, const std::string_view& db, const std::string_view& table, const std::string_view& column, const sqlite3_int64 row, const bool read_write);
+	void open_compressed(sqlite3* s, const std::string_view& db, const std::string_view& table, const std::string_view& column, const sqlite3_int64 row, PackCodec codec, std::shared_ptr<const frame_index> frames, std::uint64_t size);
 	blob_stream_buf* rdbuf();
 protected:
 	blob_stream_buf _buf;
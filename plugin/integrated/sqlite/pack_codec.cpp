@@ -0,0 +1,307 @@
+/* pack_codec.cpp - compression codecs and frame indexes for sqlite_pack entries
+ *
+ * NVGT - NonVisual Gaming Toolkit
+ * Copyright (c) 2022-2025 Sam Tupy
+ * https://nvgt.dev
+ * This software is provided "as-is", without any express or implied warranty. In no event will the authors be held liable for any damages arising from the use of this software.
+ * Permission is granted to anyone to use this software for any purpose, including commercial applications, and to alter it and redistribute it freely, subject to the following restrictions:
+ * 1. The origin of this software must not be misrepresented; you must not claim that you wrote the original software. If you use this software in a product, an acknowledgment in the product documentation would be appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include "pack_codec.h"
+#include <algorithm>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <Poco/DeflatingStream.h>
+#include <Poco/InflatingStream.h>
+#include <Poco/MemoryStream.h>
+
+using namespace std;
+
+// --- frame_index ---
+
+static uint32_t read_le32(const unsigned char* p) {
+	return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) | (static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+static void write_le32(string& out, uint32_t v) {
+	out.push_back(static_cast<char>(v & 0xff));
+	out.push_back(static_cast<char>((v >> 8) & 0xff));
+	out.push_back(static_cast<char>((v >> 16) & 0xff));
+	out.push_back(static_cast<char>((v >> 24) & 0xff));
+}
+
+frame_index frame_index::parse(const void* data, size_t size) {
+	if (!data || size < 4 || size % 4) throw runtime_error("Corrupt frame index");
+	const auto p = static_cast<const unsigned char*>(data);
+	frame_index idx(read_le32(p));
+	if (!idx.frame_size) throw runtime_error("Corrupt frame index");
+	idx.ends.reserve(size / 4 - 1);
+	for (size_t i = 4; i < size; i += 4) idx.ends.push_back(read_le32(p + i));
+	return idx;
+}
+
+string frame_index::serialize() const {
+	string out;
+	out.reserve((ends.size() + 1) * 4);
+	write_le32(out, frame_size);
+	for (const auto e : ends) write_le32(out, e);
+	return out;
+}
+
+uint32_t frame_index::frame_length(size_t frame, uint64_t total_size) const {
+	const uint64_t begin = static_cast<uint64_t>(frame) * frame_size;
+	return begin >= total_size ? 0 : static_cast<uint32_t>(min<uint64_t>(frame_size, total_size - begin));
+}
+
+// --- LZ codec ---
+// A byte oriented LZ77 variant using the LZ4 block layout: a token holding the literal and match lengths, the literals, then a 16 bit match offset. Favours decode speed over ratio.
+
+static constexpr size_t LZ_MIN_MATCH = 4;
+static constexpr size_t LZ_HASH_BITS = 14;
+// The final bytes of a block are always emitted as literals, which lets the decoder stop after a literal run without a trailing offset.
+static constexpr size_t LZ_LAST_LITERALS = 5;
+static constexpr size_t LZ_MAX_OFFSET = 65535;
+
+static uint32_t lz_read32(const unsigned char* p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static void lz_put_length(string& out, size_t len) {
+	for (; len >= 255; len -= 255) out.push_back(static_cast<char>(255));
+	out.push_back(static_cast<char>(len));
+}
+
+static void lz_emit(string& out, const unsigned char* literals, size_t literal_len, size_t match_len, size_t offset) {
+	const size_t ml = match_len ? match_len - LZ_MIN_MATCH : 0;
+	out.push_back(static_cast<char>((min<size_t>(literal_len, 15) << 4) | min<size_t>(ml, 15)));
+	if (literal_len >= 15) lz_put_length(out, literal_len - 15);
+	out.append(reinterpret_cast<const char*>(literals), literal_len);
+	if (!match_len) return;
+	out.push_back(static_cast<char>(offset & 0xff));
+	out.push_back(static_cast<char>(offset >> 8));
+	if (ml >= 15) lz_put_length(out, ml - 15);
+}
+
+static void lz_compress(const unsigned char* src, size_t size, string& out) {
+	vector<uint32_t> table(size_t(1) << LZ_HASH_BITS, 0);
+	size_t anchor = 0, pos = 0;
+	const size_t match_limit = size > LZ_LAST_LITERALS + LZ_MIN_MATCH ? size - LZ_LAST_LITERALS - LZ_MIN_MATCH : 0;
+	while (pos < match_limit) {
+		const uint32_t seq = lz_read32(src + pos);
+		const uint32_t hash = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+		const size_t candidate = table[hash];
+		table[hash] = static_cast<uint32_t>(pos);
+		if (candidate >= pos || pos - candidate > LZ_MAX_OFFSET || lz_read32(src + candidate) != seq) {
+			pos++;
+			continue;
+		}
+		size_t len = LZ_MIN_MATCH;
+		while (pos + len < size - LZ_LAST_LITERALS && src[candidate + len] == src[pos + len]) len++;
+		lz_emit(out, src + anchor, pos - anchor, len, pos - candidate);
+		pos += len;
+		anchor = pos;
+	}
+	lz_emit(out, src + anchor, size - anchor, 0, 0);
+}
+
+static bool lz_read_length(const unsigned char* src, size_t size, size_t& pos, size_t& len) {
+	unsigned char b;
+	do {
+		if (pos >= size) return false;
+		b = src[pos++];
+		len += b;
+	} while (b == 255);
+	return true;
+}
+
+static bool lz_decompress(const unsigned char* src, size_t size, unsigned char* dst, size_t dst_size) {
+	size_t ip = 0, op = 0;
+	while (ip < size) {
+		const unsigned char token = src[ip++];
+		size_t literal_len = token >> 4;
+		if (literal_len == 15 && !lz_read_length(src, size, ip, literal_len)) return false;
+		if (literal_len > size - ip || literal_len > dst_size - op) return false;
+		memcpy(dst + op, src + ip, literal_len);
+		ip += literal_len;
+		op += literal_len;
+		if (ip == size) break;
+		if (size - ip < 2) return false;
+		const size_t offset = src[ip] | (static_cast<size_t>(src[ip + 1]) << 8);
+		ip += 2;
+		if (!offset || offset > op) return false;
+		size_t match_len = token & 15;
+		if (match_len == 15 && !lz_read_length(src, size, ip, match_len)) return false;
+		match_len += LZ_MIN_MATCH;
+		if (match_len > dst_size - op) return false;
+		if (offset >= match_len) memcpy(dst + op, dst + op - offset, match_len);
+		else for (size_t i = 0; i < match_len; i++) dst[op + i] = dst[op - offset + i];
+		op += match_len;
+	}
+	return op == dst_size;
+}
+
+// --- deflate codec ---
+
+static void deflate_compress(const char* src, size_t size, string& out, int level) {
+	ostringstream compressed;
+	Poco::DeflatingOutputStream stream(compressed, Poco::DeflatingStreamBuf::STREAM_ZLIB, level);
+	stream.write(src, size);
+	stream.close();
+	out.append(compressed.str());
+}
+
+static bool deflate_decompress(const char* src, size_t size, char* dst, size_t dst_size) {
+	Poco::MemoryInputStream compressed(src, size);
+	Poco::InflatingInputStream stream(compressed, Poco::InflatingStreamBuf::STREAM_ZLIB);
+	stream.read(dst, dst_size);
+	return static_cast<size_t>(stream.gcount()) == dst_size;
+}
+
+// --- entry compression ---
+
+static void compress_frame(PackCodec codec, int level, const char* src, size_t size, string& out) {
+	switch (codec) {
+		case PackCodec::Deflate: deflate_compress(src, size, out, level); break;
+		case PackCodec::Lz: lz_compress(reinterpret_cast<const unsigned char*>(src), size, out); break;
+		default: throw invalid_argument("Unknown pack codec");
+	}
+}
+
+bool compress_entry(PackCodec codec, int level, uint32_t frame_size, const void* data, uint64_t size, compressed_entry& out) {
+	if (codec == PackCodec::None || !frame_size || !size) return false;
+	out.codec = codec;
+	out.data.clear();
+	out.frames = frame_index(frame_size);
+	const auto src = static_cast<const char*>(data);
+	for (uint64_t offset = 0; offset < size; offset += frame_size) {
+		compress_frame(codec, level, src + offset, static_cast<size_t>(min<uint64_t>(frame_size, size - offset)), out.data);
+		if (out.data.size() >= size || out.data.size() > UINT32_MAX) return false;
+		out.frames.add_frame(static_cast<uint32_t>(out.data.size()));
+	}
+	return out.data.size() + out.frames.frame_count() * 4 < size;
+}
+
+bool compress_entry(PackCodec codec, int level, uint32_t frame_size, istream& src, uint64_t size, compressed_entry& out) {
+	if (codec == PackCodec::None || !frame_size || !size) return false;
+	out.codec = codec;
+	out.data.clear();
+	out.frames = frame_index(frame_size);
+	string frame(frame_size, '\0');
+	for (uint64_t offset = 0; offset < size; offset += frame_size) {
+		const auto len = static_cast<streamsize>(min<uint64_t>(frame_size, size - offset));
+		if (!src.read(frame.data(), len)) throw runtime_error("Could not read source stream");
+		compress_frame(codec, level, frame.data(), static_cast<size_t>(len), out.data);
+		if (out.data.size() >= size || out.data.size() > UINT32_MAX) return false;
+		out.frames.add_frame(static_cast<uint32_t>(out.data.size()));
+	}
+	return out.data.size() + out.frames.frame_count() * 4 < size;
+}
+
+void decompress_frame(PackCodec codec, const void* src, size_t src_size, void* dst, size_t dst_size) {
+	bool ok = false;
+	switch (codec) {
+		case PackCodec::Deflate: ok = deflate_decompress(static_cast<const char*>(src), src_size, static_cast<char*>(dst), dst_size); break;
+		case PackCodec::Lz: ok = lz_decompress(static_cast<const unsigned char*>(src), src_size, static_cast<unsigned char*>(dst), dst_size); break;
+		default: throw runtime_error("Unknown pack codec");
+	}
+	if (!ok) throw runtime_error("Corrupt compressed frame");
+}
+
+void decompress_entry(PackCodec codec, const void* src, size_t src_size, const frame_index& frames, uint64_t size, void* dst) {
+	const auto in = static_cast<const char*>(src);
+	const auto out = static_cast<char*>(dst);
+	uint64_t done = 0;
+	for (size_t f = 0; f < frames.frame_count(); f++) {
+		const auto begin = frames.frame_begin(f);
+		const auto end = frames.frame_end(f);
+		const uint64_t len = frames.frame_length(f, size);
+		if (end < begin || end > src_size || done + len > size) throw runtime_error("Corrupt frame index");
+		decompress_frame(codec, in + begin, end - begin, out + done, len);
+		done += len;
+	}
+	if (done != size) throw runtime_error("Corrupt frame index");
+}
+
+// --- content_hasher ---
+
+static constexpr uint64_t XXH_PRIME1 = 0x9E3779B185EBCA87ULL;
+static constexpr uint64_t XXH_PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+static constexpr uint64_t XXH_PRIME3 = 0x165667B19E3779F9ULL;
+static constexpr uint64_t XXH_PRIME4 = 0x85EBCA77C2B2AE63ULL;
+static constexpr uint64_t XXH_PRIME5 = 0x27D4EB2F165667C5ULL;
+
+static uint64_t xxh_rotl(uint64_t v, int bits) {
+	return (v << bits) | (v >> (64 - bits));
+}
+
+static uint64_t xxh_read64(const unsigned char* p) {
+	uint64_t v = 0;
+	for (int i = 7; i >= 0; i--) v = (v << 8) | p[i];
+	return v;
+}
+
+static uint64_t xxh_round(uint64_t acc, uint64_t input) {
+	return xxh_rotl(acc + input * XXH_PRIME2, 31) * XXH_PRIME1;
+}
+
+static uint64_t xxh_merge(uint64_t acc, uint64_t v) {
+	return (acc ^ xxh_round(0, v)) * XXH_PRIME1 + XXH_PRIME4;
+}
+
+content_hasher::content_hasher() : acc{XXH_PRIME1 + XXH_PRIME2, XXH_PRIME2, 0, 0 - XXH_PRIME1}, buffered(0), total(0) {}
+
+void content_hasher::update(const void* data, size_t size) {
+	auto p = static_cast<const unsigned char*>(data);
+	total += size;
+	if (buffered) {
+		const size_t take = min(size, sizeof(buffer) - buffered);
+		memcpy(buffer + buffered, p, take);
+		buffered += take;
+		p += take;
+		size -= take;
+		if (buffered < sizeof(buffer)) return;
+		for (int i = 0; i < 4; i++) acc[i] = xxh_round(acc[i], xxh_read64(buffer + i * 8));
+		buffered = 0;
+	}
+	for (; size >= 32; p += 32, size -= 32) {
+		for (int i = 0; i < 4; i++) acc[i] = xxh_round(acc[i], xxh_read64(p + i * 8));
+	}
+	if (size) memcpy(buffer, p, size);
+	buffered = size;
+}
+
+uint64_t content_hasher::digest() const {
+	uint64_t h;
+	if (total >= 32) {
+		h = xxh_rotl(acc[0], 1) + xxh_rotl(acc[1], 7) + xxh_rotl(acc[2], 12) + xxh_rotl(acc[3], 18);
+		for (int i = 0; i < 4; i++) h = xxh_merge(h, acc[i]);
+	} else h = acc[2] + XXH_PRIME5;
+	h += total;
+	const unsigned char* p = buffer;
+	size_t left = buffered;
+	for (; left >= 8; p += 8, left -= 8) h = xxh_rotl(h ^ xxh_round(0, xxh_read64(p)), 27) * XXH_PRIME1 + XXH_PRIME4;
+	if (left >= 4) {
+		h = xxh_rotl(h ^ (static_cast<uint64_t>(read_le32(p)) * XXH_PRIME1), 23) * XXH_PRIME2 + XXH_PRIME3;
+		p += 4;
+		left -= 4;
+	}
+	for (; left; p++, left--) h = xxh_rotl(h ^ (*p * XXH_PRIME5), 11) * XXH_PRIME1;
+	h ^= h >> 33;
+	h *= XXH_PRIME2;
+	h ^= h >> 29;
+	h *= XXH_PRIME3;
+	h ^= h >> 32;
+	return h;
+}
+
+uint64_t content_hash(const void* data, size_t size) {
+	content_hasher hasher;
+	hasher.update(data, size);
+	return hasher.digest();
+}
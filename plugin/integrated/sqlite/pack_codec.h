@@ -0,0 +1,77 @@
+/* pack_codec.h - compression codecs and frame indexes for sqlite_pack entries
+ *
+ * NVGT - NonVisual Gaming Toolkit
+ * Copyright (c) 2022-2025 Sam Tupy
+ * https://nvgt.dev
+ * This software is provided "as-is", without any express or implied warranty. In no event will the authors be held liable for any damages arising from the use of this software.
+ * Permission is granted to anyone to use this software for any purpose, including commercial applications, and to alter it and redistribute it freely, subject to the following restrictions:
+ * 1. The origin of this software must not be misrepresented; you must not claim that you wrote the original software. If you use this software in a product, an acknowledgment in the product documentation would be appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <istream>
+
+enum class PackCodec {
+	None,
+	Deflate,
+	Lz
+};
+
+// Compressed entries are split into frames of this many uncompressed bytes, each compressed independently so that any byte range can be decoded without touching the frames before it.
+constexpr std::uint32_t DEFAULT_PACK_FRAME_SIZE = 64 * 1024;
+// Larger frames compress better but make every seek decode more; long streamed entries like music are usually best served by 256 KB to 1 MB.
+constexpr std::uint32_t MIN_PACK_FRAME_SIZE = 4 * 1024;
+constexpr std::uint32_t MAX_PACK_FRAME_SIZE = 16 * 1024 * 1024;
+
+// The frame index stored in the frames column of a compressed entry: the uncompressed frame size followed by the end offset of every compressed frame within the data column, all as little-endian 32 bit integers.
+class frame_index {
+	std::uint32_t frame_size;
+	std::vector<std::uint32_t> ends;
+public:
+	frame_index() : frame_size(DEFAULT_PACK_FRAME_SIZE) {}
+	explicit frame_index(std::uint32_t size) : frame_size(size) {}
+	static frame_index parse(const void* data, std::size_t size);
+	std::string serialize() const;
+	void add_frame(std::uint32_t compressed_end) { ends.push_back(compressed_end); }
+	std::uint32_t get_frame_size() const { return frame_size; }
+	std::size_t frame_count() const { return ends.size(); }
+	std::uint32_t frame_begin(std::size_t frame) const { return frame ? ends[frame - 1] : 0; }
+	std::uint32_t frame_end(std::size_t frame) const { return ends[frame]; }
+	// The number of uncompressed bytes held by the given frame of an entry of total_size bytes.
+	std::uint32_t frame_length(std::size_t frame, std::uint64_t total_size) const;
+};
+
+struct compressed_entry {
+	PackCodec codec = PackCodec::None;
+	std::string data;
+	frame_index frames;
+};
+
+// Compresses size bytes into out. Returns false, leaving out unusable, when the compressed form would not be smaller than the input.
+bool compress_entry(PackCodec codec, int level, std::uint32_t frame_size, const void* data, std::uint64_t size, compressed_entry& out);
+bool compress_entry(PackCodec codec, int level, std::uint32_t frame_size, std::istream& src, std::uint64_t size, compressed_entry& out);
+// Decodes one frame into dst, which must be exactly the frame's uncompressed length. Throws on corrupt input.
+void decompress_frame(PackCodec codec, const void* src, std::size_t src_size, void* dst, std::size_t dst_size);
+// Decodes every frame of an entry of size uncompressed bytes into dst. Throws on corrupt input.
+void decompress_entry(PackCodec codec, const void* src, std::size_t src_size, const frame_index& frames, std::uint64_t size, void* dst);
+
+// Streaming XXH64, used to find candidate duplicates when a pack deduplicates its content. Matches are always confirmed byte for byte, so the hash only needs to be fast and well distributed.
+class content_hasher {
+	std::uint64_t acc[4];
+	unsigned char buffer[32];
+	std::size_t buffered;
+	std::uint64_t total;
+public:
+	content_hasher();
+	void update(const void* data, std::size_t size);
+	std::uint64_t digest() const;
+};
+
+std::uint64_t content_hash(const void* data, std::size_t size);